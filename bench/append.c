@@ -0,0 +1,88 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Append latency: grows one file with small writes and prints the mean
+   time per write for each step of its size. With the tail cursor the
+   latency stays flat however long the file gets. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define WRITE_SIZE 1000
+#define STEPS 5
+
+static double now() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  char *image = argc > 1 ? argv[1] : "bench.img";
+  int mib = argc > 2 ? atoi(argv[2]) : 200;
+  char buffer[WRITE_SIZE];
+  long total = 0, target, writes;
+  double start, end;
+  int file, step;
+
+  if (mib < STEPS) {
+    printf("How-To-Use: %s [image] [MiB, at least %d]\n", argv[0], STEPS);
+    return 1;
+  }
+  memset(buffer, 'a', sizeof(buffer));
+
+  /* Room for the file plus the FAT, directory and journal */
+  unlink(image);
+  if (!bl_init(image, (mib + mib / 8 + 8) * 2048) || !fs_init() || !fs_format(0)) {
+    return 1;
+  }
+  if ((file = fs_open("big", FS_W)) == -1) {
+    return 1;
+  }
+
+  printf("%d-byte writes up to %d MiB\n", WRITE_SIZE, mib);
+  for (step = 1; step <= STEPS; step++) {
+    target = (long) mib * step / STEPS << 20;
+    start = now();
+    for (writes = 0; total < target; writes++) {
+      if (fs_write(buffer, WRITE_SIZE, file) != WRITE_SIZE) {
+        printf("Write failed at %ld bytes\n", total);
+        return 1;
+      }
+      total += WRITE_SIZE;
+    }
+    end = now();
+    printf("%4ld MiB: %.2f us/write\n", total >> 20, (end - start) / writes * 1e6);
+  }
+
+  fs_close(file);
+  fs_sync();
+  unlink(image);
+  return 0;
+}
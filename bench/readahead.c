@@ -0,0 +1,124 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Read-ahead throughput: reads one large file sequentially with several
+   buffer sizes and prints the throughput, the device reads issued and
+   the clusters read ahead and used. The host page cache hides the cost
+   of a device read, so each one can be charged a latency to model a
+   slower drive. */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define FILE_MIB 48
+#define CACHE_CLUSTERS 256  /* The default cache, 1 MiB of 4 KiB clusters */
+
+long device_reads = 0;
+int latency = 0;
+
+/* Every read of the image goes through preadv, which is counted and charged
+   latency microseconds */
+ssize_t preadv(int dev, const struct iovec *iov, int iovcnt, off_t offset) {
+  device_reads++;
+  if (latency > 0) {
+    usleep(latency);
+  }
+  return syscall(SYS_preadv, dev, iov, iovcnt, (long) offset, 0L);
+}
+
+static double now() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  static const int sizes[] = { 512, 4096, 16384, 65536, 1 << 20 };
+  char *image = argc > 1 ? argv[1] : "bench.img";
+  long total, prefetched, hits, prefetched0, hits0;
+  char *buffer;
+  double start;
+  int file, host, i, n;
+
+  latency = argc > 2 ? atoi(argv[2]) : 100;
+  if ((buffer = malloc(1 << 20)) == NULL) {
+    return 1;
+  }
+
+  unlink(image);
+  if (!bl_init(image, (FILE_MIB + 16) * 2048) || !fs_init() || !fs_format(0)) {
+    return 1;
+  }
+  if ((file = fs_open("big", FS_W)) == -1) {
+    return 1;
+  }
+  for (i = 0; i < FILE_MIB; i++) {
+    memset(buffer, i, 1 << 20);
+    fs_write(buffer, 1 << 20, file);
+  }
+  fs_close(file);
+  fs_sync();
+
+  printf("Sequential read of %d MiB, %d us per device read\n", FILE_MIB, latency);
+  for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+    /* Nothing of the file may be cached, here or in the host: a resize
+       writes the cache back and starts with empty slots */
+    if (!fs_cache(1) || !fs_cache(CACHE_CLUSTERS)) {
+      return 1;
+    }
+    if ((host = open(image, O_RDONLY)) != -1) {
+      posix_fadvise(host, 0, 0, POSIX_FADV_DONTNEED);
+      close(host);
+    }
+
+    fs_readahead_stats(&prefetched0, &hits0);
+    device_reads = 0;
+    total = 0;
+    file = fs_open("big", FS_R);
+    start = now();
+    while ((n = fs_read(buffer, sizes[i], file)) > 0) {
+      total += n;
+    }
+    start = now() - start;
+    fs_close(file);
+    fs_readahead_stats(&prefetched, &hits);
+
+    printf("%7d B buffer: %6.0f MB/s, %6ld device reads, %6ld clusters read ahead, %6ld used\n",
+           sizes[i], total / start / 1e6, device_reads, prefetched - prefetched0, hits - hits0);
+  }
+
+  free(buffer);
+  unlink(image);
+  return 0;
+}
@@ -20,47 +20,737 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
 
 #define PAGESIZE 4096
+#define HUGEPAGESIZE (2 << 20)
+
+/* Bounce buffer of bl_import/bl_export when the kernel can't copy by itself */
+#define RANGE_BUFFER (1 << 20)
+
+/* Worker threads started for asynchronous I/O */
+#define AIO_WORKERS 4
+
+/* Images a striped device can span */
+#define STRIPE_MAX 16
+
+/* Each striped image ends with a sector past its units recording its place in
+   the set, so the set is only opened again in the same order and unit. */
+#define STRIPE_MAGIC 0x50525453
+
+typedef struct {
+  unsigned int magic;
+  unsigned int set;
+  unsigned int index;
+  unsigned int count;
+  unsigned int unit;
+  off_t member;
+} stripe_head;
+
+off_t device_size;
+int fd = -1;
+
+/* The image opened again with O_DIRECT, for BL_DIRECT */
+int direct_fd = -1;
+
+/* The whole image in memory: shared mapping of the file for BL_MMAP,
+   anonymous memory for BL_RAM. image_bytes is the length mapped. */
+char *image = NULL;
+size_t image_bytes;
+
+int sync_policy = BL_SYNC_FLUSH;
+
+/* Set when the RAM disk should come from huge pages */
+int ram_huge = 0;
+
+/* Striped device: stripe_unit bytes go to each image in turn, stripe_fds[i]
+   keeps every stripe_count-th unit one after the other. */
+int stripe_fds[STRIPE_MAX];
+int stripe_count = 0;
+off_t stripe_unit;
+
+/* What a member image does for one striped request */
+typedef struct stripe_job {
+  int op;                       /* BL_READ, BL_WRITE or STRIPE_FLUSH */
+  int dev;
+  off_t offset;
+  struct iovec *iov;
+  int iovcnt;
+  struct stripe_batch *batch;
+  struct stripe_job *next;
+} stripe_job;
+
+#define STRIPE_FLUSH 2
+
+/* The jobs of one request, the caller waits until none is left */
+typedef struct stripe_batch {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int left;
+  int error;
+} stripe_batch;
+
+/* Each member image but the first has a thread of its own, so a request
+   spanning several images moves them at the same time (the caller takes the
+   first member it touches). Started when first needed and kept for the
+   images opened later; a forked child starts its own. */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  stripe_job *head, *tail;
+  int started;
+} stripe_lane;
+
+stripe_lane lanes[STRIPE_MAX];
+pthread_mutex_t lanes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A backend keeps the sectors of the device: transfer moves a whole iov at a
+   byte offset, flush carries out the sync policy and ptr gives the address of
+   an offset when the device lives in memory (NULL when it doesn't). */
+typedef struct {
+  int (*transfer)(int write, off_t offset, struct iovec *iov, int iovcnt);
+  int (*flush)();
+  char *(*ptr)(off_t offset);
+} bl_backend;
+
+static const bl_backend *backend;
+
+struct bl_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t completed;
+  int inflight;
+  bl_request *done_head, *done_tail;
+};
+
+/* Requests waiting for a worker, shared by every queue */
+pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t submit_ready = PTHREAD_COND_INITIALIZER;
+bl_request *pending_head = NULL, *pending_tail = NULL;
+int worker_count = 0;
+
+
+/* Transfers the whole iov at offset of dev, issuing one preadv/pwritev per
+   IOV_MAX buffers and resuming after short transfers. */
+static int fd_transfer(int dev, int write, off_t offset, struct iovec *iov, int iovcnt) {
+  struct iovec cur[IOV_MAX];
+  ssize_t done;
+  int n;
+
+  while (iovcnt > 0) {
+    n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+    memcpy(cur, iov, n * sizeof(struct iovec));
+    iov += n;
+    iovcnt -= n;
+    while (n > 0) {
+      if (write) {
+        done = pwritev(dev, cur, n, offset);
+      } else {
+        done = preadv(dev, cur, n, offset);
+      }
+      if (done == -1 && errno == EINTR) {
+        continue;
+      }
+      if (done <= 0) {
+        if (done == 0) {
+          errno = EIO;
+        }
+        return 0;
+      }
+      offset += done;
+      /* Skip what was transferred and retry the remainder. */
+      while (n > 0 && (size_t) done >= cur[0].iov_len) {
+        done -= cur[0].iov_len;
+        memmove(cur, cur + 1, --n * sizeof(struct iovec));
+      }
+      if (n > 0) {
+        cur[0].iov_base = (char *) cur[0].iov_base + done;
+        cur[0].iov_len -= done;
+      }
+    }
+  }
+  return 1;
+}
+
+static int fd_flush(int dev) {
+  switch (sync_policy) {
+  case BL_SYNC_FLUSH:
+    return fdatasync(dev) != -1;
+  case BL_SYNC_ASYNC:
+    return sync_file_range(dev, 0, 0, SYNC_FILE_RANGE_WRITE) != -1;
+  }
+  return 1;
+}
+
+/* Transfers aligned to BL_ALIGN bypass the page cache when there is a direct
+   descriptor. The kernel keeps both descriptors coherent. */
+static int file_transfer(int write, off_t offset, struct iovec *iov, int iovcnt) {
+  int i, aligned = direct_fd != -1 && offset % BL_ALIGN == 0;
+
+  for (i = 0; i < iovcnt && aligned; i++) {
+    aligned = (unsigned long) iov[i].iov_base % BL_ALIGN == 0 && iov[i].iov_len % BL_ALIGN == 0;
+  }
+  return fd_transfer(aligned ? direct_fd : fd, write, offset, iov, iovcnt);
+}
+
+static int file_flush() {
+  return fd_flush(fd);
+}
+
+static char *file_ptr(off_t offset) {
+  return NULL;
+}
+
+/* Copies the iov in or out of the image in memory, no system call involved. */
+static int mem_transfer(int write, off_t offset, struct iovec *iov, int iovcnt) {
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    if (offset + (off_t) iov[i].iov_len > device_size) {
+      errno = EIO;
+      return 0;
+    }
+    if (write) {
+      memcpy(image + offset, iov[i].iov_base, iov[i].iov_len);
+    } else {
+      memcpy(iov[i].iov_base, image + offset, iov[i].iov_len);
+    }
+    offset += iov[i].iov_len;
+  }
+  return 1;
+}
+
+static int mmap_flush() {
+  switch (sync_policy) {
+  case BL_SYNC_FLUSH:
+    return msync(image, device_size, MS_SYNC) != -1;
+  case BL_SYNC_ASYNC:
+    return msync(image, device_size, MS_ASYNC) != -1;
+  }
+  return 1;
+}
+
+/* Nothing backs a RAM disk, bl_dump saves it. */
+static int ram_flush() {
+  return 1;
+}
+
+static char *mem_ptr(off_t offset) {
+  return image + offset;
+}
+
+static int stripe_run(stripe_job *job) {
+  if (job->op == STRIPE_FLUSH) {
+    return fd_flush(job->dev);
+  }
+  return fd_transfer(job->dev, job->op == BL_WRITE, job->offset, job->iov, job->iovcnt);
+}
+
+/* Posts the outcome of job to its batch. */
+static void stripe_finish(stripe_job *job, int ok) {
+  stripe_batch *batch = job->batch;
+
+  pthread_mutex_lock(&batch->lock);
+  if (!ok && batch->error == 0) {
+    batch->error = errno ? errno : EIO;
+  }
+  if (--batch->left == 0) {
+    pthread_cond_signal(&batch->done);
+  }
+  pthread_mutex_unlock(&batch->lock);
+}
+
+static void *stripe_worker(void *arg) {
+  stripe_lane *lane = arg;
+  stripe_job *job;
+
+  while (1) {
+    pthread_mutex_lock(&lane->lock);
+    while (lane->head == NULL) {
+      pthread_cond_wait(&lane->ready, &lane->lock);
+    }
+    job = lane->head;
+    lane->head = job->next;
+    if (lane->head == NULL) {
+      lane->tail = NULL;
+    }
+    pthread_mutex_unlock(&lane->lock);
+    stripe_finish(job, stripe_run(job));
+  }
+  return NULL;
+}
+
+/* A forked child has none of the lane threads of its parent. */
+static void stripe_atfork() {
+  int i;
+
+  for (i = 0; i < STRIPE_MAX; i++) {
+    lanes[i].started = 0;
+  }
+  pthread_mutex_init(&lanes_lock, NULL);
+}
+
+/* Starts the thread of lane i unless it runs already. */
+static int lane_start(int i) {
+  static int registered = 0;
+  pthread_t thread;
+
+  if (__atomic_load_n(&lanes[i].started, __ATOMIC_ACQUIRE)) {
+    return 1;
+  }
+  pthread_mutex_lock(&lanes_lock);
+  if (!registered) {
+    pthread_atfork(NULL, NULL, stripe_atfork);
+    registered = 1;
+  }
+  if (!lanes[i].started) {
+    pthread_mutex_init(&lanes[i].lock, NULL);
+    pthread_cond_init(&lanes[i].ready, NULL);
+    lanes[i].head = lanes[i].tail = NULL;
+    if (pthread_create(&thread, NULL, stripe_worker, &lanes[i]) == 0) {
+      pthread_detach(thread);
+      __atomic_store_n(&lanes[i].started, 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&lanes_lock);
+  return lanes[i].started;
+}
+
+/* Carries out the jobs of members that have one (op set), the first in the
+   calling thread and the others on their lanes (or in the calling thread too
+   when a lane can't be started), and waits for all of them. */
+static int stripe_dispatch(stripe_job *jobs) {
+  stripe_batch batch;
+  int i, first = -1;
+
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.done, NULL);
+  batch.left = 0;
+  batch.error = 0;
+  for (i = 0; i < stripe_count; i++) {
+    if (jobs[i].op != -1) {
+      jobs[i].batch = &batch;
+      batch.left++;
+    }
+  }
 
-int device_size;
-FILE *stream;
+  for (i = 0; i < stripe_count; i++) {
+    if (jobs[i].op == -1) {
+      continue;
+    }
+    if (first == -1) {
+      first = i;
+      continue;
+    }
+    if (!lane_start(i)) {
+      stripe_finish(&jobs[i], stripe_run(&jobs[i]));
+      continue;
+    }
+    jobs[i].next = NULL;
+    pthread_mutex_lock(&lanes[i].lock);
+    if (lanes[i].tail != NULL) {
+      lanes[i].tail->next = &jobs[i];
+    } else {
+      lanes[i].head = &jobs[i];
+    }
+    lanes[i].tail = &jobs[i];
+    pthread_cond_signal(&lanes[i].ready);
+    pthread_mutex_unlock(&lanes[i].lock);
+  }
+  if (first != -1) {
+    stripe_finish(&jobs[first], stripe_run(&jobs[first]));
+  }
+
+  pthread_mutex_lock(&batch.lock);
+  while (batch.left > 0) {
+    pthread_cond_wait(&batch.done, &batch.lock);
+  }
+  pthread_mutex_unlock(&batch.lock);
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.done);
+  if (batch.error != 0) {
+    errno = batch.error;
+    return 0;
+  }
+  return 1;
+}
+
+/* Splits the iov at the unit boundaries and gives each member image the
+   pieces that fall on it. Consecutive units of a member are adjacent in its
+   image, so every member gets a single contiguous transfer. */
+static int stripe_transfer(int write, off_t offset, struct iovec *iov, int iovcnt) {
+  stripe_job jobs[STRIPE_MAX];
+  struct iovec *pieces;
+  int count[STRIPE_MAX], next[STRIPE_MAX];
+  off_t pos, unit, total = 0;
+  size_t left, chunk;
+  char *base;
+  int i, m, pass, ok;
+
+  for (i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if (offset + total > device_size) {
+    errno = EIO;
+    return 0;
+  }
+  if (total == 0) {
+    return 1;
+  }
+
+  /* Within a unit: one member, the iov as it is */
+  unit = offset / stripe_unit;
+  if (unit == (offset + total - 1) / stripe_unit) {
+    return fd_transfer(stripe_fds[unit % stripe_count], write,
+                       unit / stripe_count * stripe_unit + offset % stripe_unit, iov, iovcnt);
+  }
+
+  /* Every piece ends an iov or a unit */
+  pieces = malloc((iovcnt + total / stripe_unit + 2) * sizeof(struct iovec));
+  if (pieces == NULL) {
+    return 0;
+  }
+  for (m = 0; m < stripe_count; m++) {
+    count[m] = 0;
+    jobs[m].op = -1;
+  }
+  /* First pass counts the pieces of each member, second one fills them in */
+  for (pass = 0; pass < 2; pass++) {
+    pos = offset;
+    for (i = 0; i < iovcnt; i++) {
+      base = iov[i].iov_base;
+      for (left = iov[i].iov_len; left > 0; left -= chunk) {
+        unit = pos / stripe_unit;
+        m = unit % stripe_count;
+        chunk = stripe_unit - pos % stripe_unit;
+        if (chunk > left) {
+          chunk = left;
+        }
+        if (pass == 0) {
+          if (count[m]++ == 0) {
+            jobs[m].op = write ? BL_WRITE : BL_READ;
+            jobs[m].dev = stripe_fds[m];
+            jobs[m].offset = unit / stripe_count * stripe_unit + pos % stripe_unit;
+          }
+        } else {
+          pieces[next[m]].iov_base = base;
+          pieces[next[m]++].iov_len = chunk;
+        }
+        base += chunk;
+        pos += chunk;
+      }
+    }
+    if (pass == 0) {
+      for (m = 0, i = 0; m < stripe_count; i += count[m++]) {
+        next[m] = i;
+        jobs[m].iov = &pieces[i];
+        jobs[m].iovcnt = count[m];
+      }
+    }
+  }
+
+  ok = stripe_dispatch(jobs);
+  free(pieces);
+  return ok;
+}
+
+static int stripe_flush() {
+  stripe_job jobs[STRIPE_MAX];
+  int m;
+
+  for (m = 0; m < stripe_count; m++) {
+    jobs[m].op = STRIPE_FLUSH;
+    jobs[m].dev = stripe_fds[m];
+  }
+  return stripe_dispatch(jobs);
+}
+
+static const bl_backend backends[] = {
+  { file_transfer, file_flush, file_ptr },      /* BL_FILE */
+  { mem_transfer, mmap_flush, mem_ptr },        /* BL_MMAP */
+  { mem_transfer, ram_flush, mem_ptr },         /* BL_RAM */
+  { stripe_transfer, stripe_flush, file_ptr }   /* BL_STRIPE */
+};
+
+/* Moves bytes between memory and a host file at hostoff with pread/pwrite
+   (out says which way). */
+static int mem_range(int out, char *mem, int hostfd, off_t hostoff, size_t bytes) {
+  ssize_t n;
+
+  while (bytes > 0) {
+    if (out) {
+      n = pwrite(hostfd, mem, bytes, hostoff);
+    } else {
+      n = pread(hostfd, mem, bytes, hostoff);
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      return 0;
+    }
+    mem += n;
+    hostoff += n;
+    bytes -= n;
+  }
+  return 1;
+}
+
+/* Gives the RAM disk size bytes of zeroed anonymous memory, from huge pages
+   if asked and the host has them reserved, else from normal pages the kernel
+   may still merge into transparent huge pages. Huge pages are reserved up
+   front (no MAP_NORESERVE), a fault on a missing one would be a SIGBUS. */
+static int ram_alloc(off_t size, int huge) {
+  if (image != NULL) {
+    munmap(image, image_bytes);
+  }
+  image = MAP_FAILED;
+  if (huge) {
+    image_bytes = (size + HUGEPAGESIZE - 1) / HUGEPAGESIZE * HUGEPAGESIZE;
+    image = mmap(NULL, image_bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (image == MAP_FAILED) {
+    image_bytes = size;
+    image = mmap(NULL, image_bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (image != MAP_FAILED && huge) {
+      madvise(image, image_bytes, MADV_HUGEPAGE);
+    }
+  }
+  if (image == MAP_FAILED) {
+    image = NULL;
+    perror("Allocating the RAM disk");
+    return 0;
+  }
+  device_size = size;
+  return 1;
+}
 
 int bl_init(char *file, int size) {
+  return bl_open(file, size, BL_FILE);
+}
+
+/* Lets go of the image opened before. */
+static void bl_close() {
+  if (image != NULL) {
+    munmap(image, image_bytes);
+    image = NULL;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  fd = -1;
+  if (direct_fd != -1) {
+    close(direct_fd);
+  }
+  direct_fd = -1;
+  while (stripe_count > 0) {
+    close(stripe_fds[--stripe_count]);
+  }
+}
+
+int bl_open(char *file, int size, int type) {
+  int huge = type & BL_HUGE, direct = type & BL_DIRECT;
   struct stat sb;
 
-  stream = NULL;
+  bl_close();
+
+  type &= ~(BL_HUGE | BL_DIRECT);
+  if (type == BL_RAM) {
+    backend = &backends[type];
+    ram_huge = huge;
+    if (file != NULL && stat(file, &sb) == 0) {
+      return bl_load(file);
+    }
+    if (size < 1) {
+      printf("Image can't have size 0\n");
+      return 0;
+    }
+    return ram_alloc((off_t) size * SECTORSIZE, huge);
+  }
+
   if (stat(file, &sb) == 0) {
     if (S_ISREG(sb.st_mode)) {
       device_size = sb.st_size;
-      stream = fopen(file, "r+");
+      fd = open(file, O_RDWR);
     }
-    if (stream == NULL) {
+    if (fd == -1) {
       perror("Opening existing image...");
       return 0;
     }
   } else {
-    device_size = size * SECTORSIZE;
+    device_size = (off_t) size * SECTORSIZE;
     if (device_size < 1) {
       printf("Image can't have size 0\n");
       return 0;
     }
-    stream = fopen(file, "w+");
-    if (stream == NULL) {
+    fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
       perror("Creating new image");
       return 0;
     }
-    if (truncate(file, device_size) == -1) {
+    if (ftruncate(fd, device_size) == -1) {
       perror("Adjusting image size");
       return 0;
     }
   }
-  return 1; 
+
+  if (type == BL_MMAP) {
+    image_bytes = device_size;
+    image = mmap(NULL, image_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+      image = NULL;
+      perror("Mapping the image");
+      return 0;
+    }
+  } else if (type != BL_FILE) {
+    printf("Unknown backend %d\n", type);
+    close(fd);
+    fd = -1;
+    return 0;
+  } else if (direct && (direct_fd = open(file, O_RDWR | O_DIRECT)) == -1) {
+    perror("Direct I/O unavailable, using the page cache");
+  }
+  backend = &backends[type];
+  return 1;
+}
+
+/* Reads the header at the end of striped image i of count and checks it against
+   the set and unit being opened, or the first image's header in *set. */
+static int stripe_check(char *file, int i, int count, int unit, off_t size, stripe_head *set) {
+  char sector[SECTORSIZE];
+  stripe_head head;
+
+  if (size < SECTORSIZE || pread(stripe_fds[i], sector, SECTORSIZE, size - SECTORSIZE) != SECTORSIZE) {
+    printf("%s is not part of a striped image\n", file);
+    return 0;
+  }
+  memcpy(&head, sector, sizeof(head));
+  if (head.magic != STRIPE_MAGIC || head.member != size - SECTORSIZE) {
+    printf("%s is not part of a striped image\n", file);
+    return 0;
+  }
+  if (i == 0) {
+    *set = head;
+  }
+  if (head.count != (unsigned int) count || head.index != (unsigned int) i) {
+    printf("%s is file %u of %u of its striped image, not %d of %d\n", file,
+           head.index + 1, head.count, i + 1, count);
+    return 0;
+  }
+  if (head.unit != (unsigned int) unit) {
+    printf("%s is striped in %u KiB units, not %d\n", file, head.unit / 2, unit / 2);
+    return 0;
+  }
+  if (head.set != set->set || head.member != set->member) {
+    printf("%s belongs to another striped image\n", file);
+    return 0;
+  }
+  return 1;
+}
+
+int bl_open_stripe(char **files, int count, int size, int unit) {
+  char sector[SECTORSIZE];
+  stripe_head head;
+  struct stat sb;
+  off_t member = 0;
+  int i, existing = 0;
+
+  bl_close();
+  if (count < 1 || count > STRIPE_MAX) {
+    printf("A striped image has 1 to %d files\n", STRIPE_MAX);
+    return 0;
+  }
+  if (unit < 1) {
+    printf("Stripe unit can't be 0\n");
+    return 0;
+  }
+  stripe_unit = (off_t) unit * SECTORSIZE;
+
+  for (i = 0; i < count; i++) {
+    if (stat(files[i], &sb) == 0) {
+      if (!S_ISREG(sb.st_mode)) {
+        printf("%s is not an image file\n", files[i]);
+        return 0;
+      }
+      existing++;
+    }
+  }
+  if (existing > 0 && existing < count) {
+    printf("Some of the striped images are missing\n");
+    return 0;
+  }
+
+  /* New images get an even share of size and a header naming their place */
+  memset(&head, 0, sizeof(head));
+  if (existing == 0) {
+    member = ((off_t) size * SECTORSIZE + count - 1) / count;
+    member = (member + stripe_unit - 1) / stripe_unit * stripe_unit;
+    if (member < 1) {
+      printf("Image can't have size 0\n");
+      return 0;
+    }
+    head.magic = STRIPE_MAGIC;
+    head.set = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+    head.count = count;
+    head.unit = unit;
+    head.member = member;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (existing > 0) {
+      stripe_fds[i] = open(files[i], O_RDWR);
+    } else {
+      stripe_fds[i] = open(files[i], O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+    if (stripe_fds[i] == -1) {
+      perror(files[i]);
+      bl_close();
+      return 0;
+    }
+    stripe_count++;
+
+    if (existing > 0) {
+      if (fstat(stripe_fds[i], &sb) == -1 ||
+          !stripe_check(files[i], i, count, unit, sb.st_size, &head)) {
+        bl_close();
+        return 0;
+      }
+      member = head.member;
+    } else {
+      head.index = i;
+      memset(sector, 0, SECTORSIZE);
+      memcpy(sector, &head, sizeof(head));
+      if (ftruncate(stripe_fds[i], member + SECTORSIZE) == -1 ||
+          pwrite(stripe_fds[i], sector, SECTORSIZE, member) != SECTORSIZE) {
+        perror(files[i]);
+        bl_close();
+        return 0;
+      }
+    }
+  }
+
+  device_size = member * count;
+  backend = &backends[BL_STRIPE];
+  return 1;
 }
 
 int bl_size() {
@@ -68,29 +758,372 @@ int bl_size() {
 }
 
 int bl_write(int sector, char *buffer) {
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Error positioning sector for write operation.");
+  struct iovec iov = { buffer, SECTORSIZE };
+
+  return bl_writev(sector, &iov, 1);
+}
+
+int bl_read(int sector, char *buffer){
+  struct iovec iov = { buffer, SECTORSIZE };
+
+  return bl_readv(sector, &iov, 1);
+}
+
+int bl_writev(int sector, struct iovec *iov, int iovcnt) {
+  if (!backend->transfer(1, (off_t) sector * SECTORSIZE, iov, iovcnt)) {
+    perror("Error writing sector");
     return 0;
   }
-  if (fwrite(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Error writing sector");
+  return 1;
+}
+
+int bl_readv(int sector, struct iovec *iov, int iovcnt) {
+  if (!backend->transfer(0, (off_t) sector * SECTORSIZE, iov, iovcnt)) {
+    perror("Error reading sector");
     return 0;
   }
-  if (fflush(stream) != 0) {
-    perror("Error writing sector on disk");
+  return 1;
+}
+
+/* Copies bytes from one descriptor to another with copy_file_range, falling back
+   to pread/pwrite through a large buffer where the kernel can't do it (different
+   file systems, old kernels). */
+static int bl_range(int from, off_t from_off, int to, off_t to_off, size_t bytes) {
+  char *buffer = NULL;
+  ssize_t n, w, done;
+
+  while (bytes > 0) {
+    n = copy_file_range(from, &from_off, to, &to_off, bytes, 0);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      break;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      return 0;
+    }
+    bytes -= n;
+  }
+
+  if (bytes > 0 && (buffer = malloc(RANGE_BUFFER)) == NULL) {
     return 0;
   }
+  while (bytes > 0) {
+    n = pread(from, buffer, bytes < RANGE_BUFFER ? bytes : RANGE_BUFFER, from_off);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      free(buffer);
+      return 0;
+    }
+    for (done = 0; done < n; ) {
+      w = pwrite(to, buffer + done, n - done, to_off + done);
+      if (w == -1 && errno == EINTR) {
+        continue;
+      }
+      if (w <= 0) {
+        free(buffer);
+        return 0;
+      }
+      done += w;
+    }
+    from_off += n;
+    to_off += n;
+    bytes -= n;
+  }
+  free(buffer);
   return 1;
 }
 
-int bl_read(int sector, char *buffer){
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Error positioning sector for read operation.");
+/* Moves bytes between offset of the device and a host file at hostoff (out
+   says which way): inside the kernel for an image file, straight from memory
+   for an image in memory and through a bounce buffer otherwise (aligned, so
+   direct I/O keeps the image out of the page cache). */
+static int host_range(int out, off_t offset, int hostfd, off_t hostoff, size_t bytes) {
+  struct iovec iov;
+  void *buffer;
+  size_t n;
+  int ok = 1;
+
+  if (fd != -1 && direct_fd == -1) {
+    return out ? bl_range(fd, offset, hostfd, hostoff, bytes) :
+                 bl_range(hostfd, hostoff, fd, offset, bytes);
+  }
+  if (image != NULL) {
+    return mem_range(out, image + offset, hostfd, hostoff, bytes);
+  }
+
+  if (posix_memalign(&buffer, BL_ALIGN, RANGE_BUFFER) != 0) {
     return 0;
   }
-  if (fread(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Error reading sector");
+  while (ok && bytes > 0) {
+    n = bytes < RANGE_BUFFER ? bytes : RANGE_BUFFER;
+    if (n > BL_ALIGN) {
+      n -= n % BL_ALIGN;        /* an unaligned tail goes on its own */
+    }
+    iov.iov_base = buffer;
+    iov.iov_len = n;
+    if (out) {
+      ok = backend->transfer(0, offset, &iov, 1) && mem_range(1, buffer, hostfd, hostoff, n);
+    } else {
+      ok = mem_range(0, buffer, hostfd, hostoff, n) && backend->transfer(1, offset, &iov, 1);
+    }
+    offset += n;
+    hostoff += n;
+    bytes -= n;
+  }
+  free(buffer);
+  return ok;
+}
+
+int bl_import(int sector, int hostfd, off_t hostoff, size_t bytes) {
+  if (!host_range(0, (off_t) sector * SECTORSIZE, hostfd, hostoff, bytes)) {
+    perror("Error importing to sector");
+    return 0;
+  }
+  return 1;
+}
+
+int bl_export(int sector, int hostfd, off_t hostoff, size_t bytes) {
+  if (!host_range(1, (off_t) sector * SECTORSIZE, hostfd, hostoff, bytes)) {
+    perror("Error exporting from sector");
     return 0;
   }
   return 1;
 }
+
+int bl_load(char *file) {
+  struct stat sb;
+  int in, ok;
+
+  if (backend != &backends[BL_RAM]) {
+    printf("Only a RAM disk can load an image\n");
+    return 0;
+  }
+  if ((in = open(file, O_RDONLY)) == -1 || fstat(in, &sb) == -1) {
+    perror("Opening image to load");
+    if (in != -1) {
+      close(in);
+    }
+    return 0;
+  }
+  if (sb.st_size < 1) {
+    printf("Image can't have size 0\n");
+    close(in);
+    return 0;
+  }
+  if (image != NULL && sb.st_size == device_size) {
+    ok = 1;
+  } else {
+    ok = ram_alloc(sb.st_size, ram_huge);
+  }
+  if (ok && !(ok = host_range(0, 0, in, 0, device_size))) {
+    perror("Loading image");
+  }
+  close(in);
+  return ok;
+}
+
+/* Tells whether host descriptor out is one of the files the device lives in. */
+static int bl_same(int out) {
+  struct stat a, b;
+  int i;
+
+  if (fstat(out, &a) == -1) {
+    return 1;
+  }
+  if (fd != -1 && fstat(fd, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+    return 1;
+  }
+  for (i = 0; i < stripe_count; i++) {
+    if (fstat(stripe_fds[i], &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int bl_dump(char *file) {
+  int out, ok;
+
+  /* Truncated only once it is known not to be the device itself */
+  if ((out = open(file, O_WRONLY | O_CREAT, 0666)) == -1) {
+    perror("Creating image to dump");
+    return 0;
+  }
+  if (bl_same(out)) {
+    printf("Can't dump the image onto itself\n");
+    close(out);
+    return 0;
+  }
+  ok = ftruncate(out, 0) != -1 && host_range(1, 0, out, 0, device_size);
+  if (ok && sync_policy == BL_SYNC_FLUSH) {
+    ok = fdatasync(out) != -1;
+  }
+  if (!ok) {
+    perror("Dumping image");
+  }
+  close(out);
+  return ok;
+}
+
+void *bl_map(int sector, size_t bytes) {
+  void *ptr;
+
+  if (fd == -1 || direct_fd != -1 || ((off_t) sector * SECTORSIZE) % PAGESIZE != 0 ||
+      (off_t) sector * SECTORSIZE + (off_t) bytes > device_size) {
+    return NULL;
+  }
+  ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t) sector * SECTORSIZE);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+void bl_unmap(void *ptr, size_t bytes) {
+  munmap(ptr, bytes);
+}
+
+char *bl_ptr(int sector) {
+  return backend->ptr((off_t) sector * SECTORSIZE);
+}
+
+void bl_sync_policy(int policy) {
+  sync_policy = policy;
+}
+
+int bl_flush() {
+  if (!backend->flush()) {
+    perror("Flushing the image");
+    return 0;
+  }
+  return 1;
+}
+
+/* Worker thread: carries out pending requests and posts them to the
+   completion list of their queue. */
+static void *bl_worker(void *arg) {
+  bl_request *req;
+  bl_queue *queue;
+
+  while (1) {
+    pthread_mutex_lock(&submit_lock);
+    while (pending_head == NULL) {
+      pthread_cond_wait(&submit_ready, &submit_lock);
+    }
+    req = pending_head;
+    pending_head = req->next;
+    if (pending_head == NULL) {
+      pending_tail = NULL;
+    }
+    pthread_mutex_unlock(&submit_lock);
+
+    if (req->op == BL_WRITE) {
+      req->result = bl_writev(req->sector, req->iov, req->iovcnt);
+    } else {
+      req->result = bl_readv(req->sector, req->iov, req->iovcnt);
+    }
+
+    queue = req->queue;
+    pthread_mutex_lock(&queue->lock);
+    req->next = NULL;
+    if (queue->done_tail != NULL) {
+      queue->done_tail->next = req;
+    } else {
+      queue->done_head = req;
+    }
+    queue->done_tail = req;
+    pthread_cond_broadcast(&queue->completed);
+    pthread_mutex_unlock(&queue->lock);
+  }
+  return NULL;
+}
+
+bl_queue *bl_queue_create() {
+  bl_queue *queue = calloc(1, sizeof(bl_queue));
+
+  if (queue == NULL) {
+    perror("Creating I/O queue");
+    return NULL;
+  }
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->completed, NULL);
+  return queue;
+}
+
+void bl_queue_destroy(bl_queue *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->completed);
+  free(queue);
+}
+
+int bl_submit(bl_queue *queue, bl_request **requests, int count) {
+  pthread_t thread;
+  int i;
+
+  pthread_mutex_lock(&submit_lock);
+  /* Workers are only started once someone needs them. */
+  while (worker_count < AIO_WORKERS) {
+    if (pthread_create(&thread, NULL, bl_worker, NULL) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    worker_count++;
+  }
+  if (worker_count == 0) {
+    pthread_mutex_unlock(&submit_lock);
+    printf("No I/O worker could be started\n");
+    return 0;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->inflight += count;
+  pthread_mutex_unlock(&queue->lock);
+
+  for (i = 0; i < count; i++) {
+    requests[i]->queue = queue;
+    requests[i]->next = NULL;
+    if (pending_tail != NULL) {
+      pending_tail->next = requests[i];
+    } else {
+      pending_head = requests[i];
+    }
+    pending_tail = requests[i];
+  }
+  pthread_cond_broadcast(&submit_ready);
+  pthread_mutex_unlock(&submit_lock);
+  return count;
+}
+
+int bl_complete(bl_queue *queue, bl_request **requests, int min, int max) {
+  int n = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (min > queue->inflight) {
+    min = queue->inflight;
+  }
+  while (n < max) {
+    if (queue->done_head == NULL) {
+      if (n >= min) {
+        break;
+      }
+      pthread_cond_wait(&queue->completed, &queue->lock);
+      continue;
+    }
+    requests[n] = queue->done_head;
+    queue->done_head = requests[n]->next;
+    if (queue->done_head == NULL) {
+      queue->done_tail = NULL;
+    }
+    queue->inflight--;
+    n++;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return n;
+}
@@ -20,9 +20,100 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/uio.h>
+
 #define SECTORSIZE 512
 
+/* Backends: where the sectors of the image are kept between bl_open and
+   the host file. */
+#define BL_FILE 0               /* read and written with preadv/pwritev */
+#define BL_MMAP 1               /* mapped shared, reads and writes are memcpy */
+#define BL_RAM 2                /* anonymous memory, no file behind it */
+#define BL_STRIPE 3             /* several image files, see bl_open_stripe */
+#define BL_HUGE 0x100           /* or'ed with BL_RAM: use huge pages if possible */
+#define BL_DIRECT 0x200         /* or'ed with BL_FILE: direct I/O, see BL_ALIGN */
+
+/* With BL_DIRECT, transfers whose offset, buffers and lengths are multiples
+   of BL_ALIGN skip the host page cache; the others still go through it. */
+#define BL_ALIGN 4096
+
+/* Opens (or creates, with size sectors) the image file with the given
+   backend. bl_init opens it with BL_FILE. A RAM disk is loaded from file
+   when it exists (file may be NULL) and starts zeroed otherwise. */
+int bl_open(char *file, int size, int type);
 int bl_init(char *file, int size);
+
+/* Opens count image files (or creates them, sharing size sectors) as one
+   device striped RAID-0 style: unit sectors go to each file in turn.
+   Transfers spanning several files move them in parallel. */
+#define STRIPE_UNIT 128         /* sectors, the default unit */
+
+int bl_open_stripe(char **files, int count, int size, int unit);
 int bl_size();
 int bl_write(int sector, char* buffer);
 int bl_read(int sector, char* buffer);
+
+/* Vectored I/O: moves a run of contiguous sectors starting at sector,
+   scattered over (or gathered from) iov. Every iov_len must be a multiple
+   of SECTORSIZE. */
+int bl_writev(int sector, struct iovec *iov, int iovcnt);
+int bl_readv(int sector, struct iovec *iov, int iovcnt);
+
+/* Address of sector in memory, for backends that keep the image there (NULL
+   otherwise). Writes through it reach the image as bl_writev would. With
+   BL_MMAP a write the host can't store (its file system is full) kills the
+   process with SIGBUS. */
+char *bl_ptr(int sector);
+
+/* What bl_flush does, for every backend. */
+#define BL_SYNC_FLUSH 0         /* wait until written data is stable (default) */
+#define BL_SYNC_ASYNC 1         /* start writing it back, don't wait */
+#define BL_SYNC_NONE 2          /* nothing, the host writes back when it wants */
+
+void bl_sync_policy(int policy);
+
+/* Waits until everything written so far is on stable storage, unless the
+   sync policy says otherwise. */
+int bl_flush();
+
+/* Move bytes between sectors of the image and a host file at hostoff, inside
+   the kernel when it can (copy_file_range). */
+int bl_import(int sector, int hostfd, off_t hostoff, size_t bytes);
+int bl_export(int sector, int hostfd, off_t hostoff, size_t bytes);
+
+/* Replace the contents of a RAM disk with an image file (its size too), or
+   save the contents of any image to one (never one of the files the device
+   lives in). */
+int bl_load(char *file);
+int bl_dump(char *file);
+
+/* Maps bytes of the image from sector (a page boundary) into memory, copy on
+   write: pages are read from the image when first touched and changes stay
+   in memory until written with bl_writev. Returns NULL if it can't be mapped,
+   as with direct I/O, whose writes could leave the mapping stale. */
+void *bl_map(int sector, size_t bytes);
+void bl_unmap(void *ptr, size_t bytes);
+
+/* Asynchronous I/O: requests are submitted to a queue in batches, carried
+   out by a pool of worker threads and reaped from the same queue in
+   completion order. */
+#define BL_READ 0
+#define BL_WRITE 1
+
+typedef struct bl_queue bl_queue;
+
+typedef struct bl_request {
+  int op;                   /* BL_READ or BL_WRITE */
+  int sector;               /* first sector of the transfer */
+  struct iovec *iov;        /* buffers, as in bl_readv/bl_writev */
+  int iovcnt;
+  int result;               /* 1 on success, 0 on failure, once completed */
+  void *data;               /* free for the submitter */
+  bl_queue *queue;          /* owned by the engine */
+  struct bl_request *next;
+} bl_request;
+
+bl_queue *bl_queue_create();
+void bl_queue_destroy(bl_queue *queue);
+int bl_submit(bl_queue *queue, bl_request **requests, int count);
+int bl_complete(bl_queue *queue, bl_request **requests, int min, int max);
@@ -27,44 +27,340 @@ Rodrigo Nascimento de Carvalho
 */
 
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "disk.h"
 #include "fs.h"
 
-#define CLUSTERSIZE 4096
+/* Cluster size of the image: a power of two from CLUSTER_MIN up to CLUSTER_MAX, chosen
+   by fs_format and read back from the superblock. */
+#define CLUSTER_MIN 4096
+#define CLUSTER_MAX (1 << 20)
 
+int cluster_size = CLUSTER_MIN;
+int cluster_sectors = CLUSTER_MIN/SECTORSIZE;
 
-unsigned short fat[65536];
+/* Default size of the buffer cache (1 MiB), never less than CACHE_MIN clusters. */
+#define CACHE_BYTES (1 << 20)
+#define CACHE_MIN 16
+#define CACHE_CLUSTERS (CACHE_BYTES/cluster_size > CACHE_MIN ? CACHE_BYTES/cluster_size : CACHE_MIN)
+
+/* Clusters fs_copy moves at a time (256 KiB, or a single large cluster). */
+#define COPY_BYTES (256 << 10)
+#define COPY_CLUSTERS (COPY_BYTES/cluster_size > 0 ? COPY_BYTES/cluster_size : 1)
+
+/* Cluster buffers of fs_read/fs_write kept for reuse. Buffers are aligned to BL_ALIGN so
+   the disk can move them with direct I/O. */
+#define POOL_MAX 16
+
+/* Read-ahead window of a sequential reader, in clusters (16 KiB up to 256 KiB). */
+#define RA_MIN 4
+#define RA_MAX 64
+
+/* Superblock, the first sector of cluster 0. The FAT follows in fat_clusters clusters,
+   one 32-bit entry per cluster of the image, then the first directory cluster (dir_first)
+   and the journal region (log_first); files get the clusters from data_first on. */
+#define FS_MAGIC 0x53465352
+#define FS_VERSION 2
+
+typedef struct {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int cluster_size;
+	unsigned int clusters;
+	unsigned int fat_clusters;
+	unsigned int log_clusters;
+} fs_super;
+
+int fat_clusters = 0;
+int dir_first = 0;
+int log_first = 0;
+int log_clusters = 0;
+int data_first = 0;
+
+/* FAT entries hold the next cluster of the chain or one of these */
+#define FAT_FREE 0
+#define FAT_EOF 0xFFFFFFFFu
+#define FAT_SYSTEM 0xFFFFFFFEu
+#define FAT_DIR_END 0xFFFFFFFDu
+
+/* The FAT of a mounted image is mapped from it (fat_mapped bytes) and read as it is used,
+   a formatted one is allocated */
+unsigned int *fat = NULL;
+size_t fat_mapped = 0;
 
 
 typedef struct {
 	char used;
-	char name[25];
-	unsigned short first_block;
+	char name[23];
+	unsigned int first_block;
 	int size;
 } dir_entry;
 
-/*Estrutura utilizada na lista de arquivos abertos, contém modo, counter de leitura/escrita, id, index do arquivo no diretorio, current_pos de leitura e counter geral de leitura*/
+/*Estrutura utilizada na lista de arquivos abertos, contém modo, counter de leitura/escrita, id, index do arquivo no diretorio, current_pos de leitura e counter geral de leitura.
+	tail_block/tail_offset are the append cursor of write mode: the last cluster of the file and where the next byte goes in it.
+	map translates the n-th cluster of the file to its block, built from the FAT chain as far as it has been needed.
+	id is the handle while the file is open and -1 otherwise, gen counts how many times the slot was used.
+	ra_last is the last cluster fs_read used, ra_window the read-ahead window (0 while access is random)
+	and ra_end the first cluster not prefetched yet.
+	lock serializes the calls made on the handle*/
 typedef struct {
 	char mode;
 	int id;
+	int gen;
+	int next_free;
 	int index;
+	int life;
 	int counter;
 	int current_pos;
 	int total;
+	int tail_block;
+	int tail_offset;
+	unsigned int *map;
+	int map_len;
+	int map_cap;
+	int map_gen;
+	int ra_last;
+	int ra_window;
+	int ra_end;
+	pthread_mutex_t lock;
 } opened_file;
 
-char * buffer;
+/* Directory: chain of clusters starting at dir_first whose last FAT entry is FAT_DIR_END.
+   dir_blocks lists the chain, each cluster holds DIR_PER_BLOCK entries of dir. */
+#define DIR_PER_BLOCK ((int) (cluster_size/sizeof(dir_entry)))
+
+dir_entry *dir = NULL;
+int dir_entries = 0;
+int *dir_blocks = NULL;
+int dir_clusters = 0;
+
+/* Bumped whenever the cluster chain of a directory entry is freed or moved,
+   cluster maps built for an older generation are discarded. */
+int *dir_gen = NULL;
+
+/* Bumped whenever a directory entry is removed or rolled back, a handle opened on an
+   older lifetime of the entry is stale and handle_lock refuses it. */
+int *dir_life = NULL;
+
+/* Bumped whenever a write mode handle takes an entry's file, a copy of the file made
+   before may be out of date. */
+int *dir_writes = NULL;
+
+/* Handles open on each directory entry. Changed under a read lock of the directory
+   (atomically), so an entry nobody has open stays that way while it is write-locked. */
+int *dir_opened = NULL;
+
+/*Opened directory files: a table of opened_slots slots that grows on demand.
+  The pointer array is allocated once for every possible slot, so slots never
+  move and can be found without locking the table. Closed slots are linked
+  from free_slot through next_free. */
+opened_file **opened_file_list = NULL;
+int opened_slots = 0;
+int free_slot = -1;
+
+/* Name index: open addressing hash table of directory entries keyed by name,
+   name_table[h] is an entry of dir[] or -1. dir_used counts the entries in use and
+   dir_hint is the lowest entry that may be unused. */
+int *name_table = NULL;
+int name_buckets = 0;
+int dir_used = 0;
+int dir_hint = 0;
+
+/* Metadata not written to its place on disk yet: FAT clusters and directory entries. */
+char *fat_dirty = NULL;
+char *dir_dirty = NULL;
+int dir_dirty_lo = 0, dir_dirty_hi = -1;
+
+/* Free cluster index: one bit per cluster (set = free) kept in sync with
+   fat[] by fat_set(), the number of free clusters and the clusters on disk. */
+unsigned long *free_map = NULL;
+int free_count = 0;
+int free_limit = 0;
+
+/* Clusters freed since the metadata last reached the disk (the journal, or home
+   without one) are held out of free_map. Reused before that, a crash would give
+   them back to their old file holding the new owner's data. */
+int *free_held = NULL;
+int free_held_len = 0, free_held_cap = 0, free_held_count = 0;
+
+/* The index is built by up to FREE_THREADS threads, each given FREE_SLICE clusters or more */
+#define FREE_THREADS 4
+#define FREE_SLICE (1 << 20)
+
+typedef struct {
+	int from, to;
+	int count;
+} free_part;
+
+/* Metadata journal: log_clusters clusters (LOG_BYTES, at least one cluster) after the
+   first directory cluster, marked LOG_MARK in the FAT. The first sector holds a log_head,
+   the commit blocks follow it, each a log_block header and the records of a group of FAT
+   and directory changes made since the last checkpoint. Images without the region run
+   without a journal. */
+#define LOG_MARK 0xFFFFFFFCu
+#define LOG_BYTES (256 << 10)
+#define LOG_MAGIC 0x474c5352
+
+/* Group commit: a block is written once LOG_GROUP records wait or LOG_DELAY ms after
+   the first of them. A FAT sector with more than LOG_DENSE changed entries is logged whole. */
+#define LOG_GROUP 256
+#define LOG_DELAY 50
+#define LOG_DENSE 32
+
+/* Record types: a FAT entry (value), a FAT sector from entry index (image follows),
+   a directory entry (entry follows) */
+#define LOG_FAT 1
+#define LOG_FATSEC 2
+#define LOG_DIR 3
+
+typedef struct {
+	unsigned int magic;
+	unsigned int epoch;
+} log_head;
 
-dir_entry dir[128];
+typedef struct {
+	unsigned int magic;
+	unsigned int epoch;
+	unsigned int bytes;
+	unsigned int sum;
+} log_block;
 
-/*Opened directory files*/
-opened_file opened_file_list[128];
+typedef struct {
+	unsigned int type;
+	unsigned int value;
+	int index;
+} log_record;
+
+/* Changes not in the log yet: FAT entries (and the sectors holding them) and directory
+   entries, log_records counts them. log_tail is the next free sector of the region. */
+int log_enabled = 0;
+unsigned int log_epoch = 0;
+int log_sectors = 0;
+int log_tail = 1;
+int log_records = 0;
+char *log_buf = NULL;
+char *fat_pending = NULL;
+char *fat_pending_sec = NULL;
+int fat_sectors = 0;
+char *dir_pending = NULL;
+int dir_pending_lo = 0, dir_pending_hi = -1;
+pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+/* Transaction opened by fs_begin: metadata changes are only persisted by fs_commit.
+   fs_abort brings fat[] back from the undo log, the old value of every entry the
+   transaction changed (txn_saved marks them), and the directory back to the copy
+   taken by fs_begin. An undo log that couldn't grow leaves txn_undo_len at -1.
+   txn_seq changes whenever a transaction opens or ends, and txn_copies counts the
+   copies reserved inside the open one and not published yet. */
+typedef struct {
+	int index;
+	unsigned int value;
+} txn_record;
+
+int txn_active = 0;
+txn_record *txn_undo = NULL;
+int txn_undo_len = 0;
+int txn_undo_cap = 0;
+unsigned long *txn_saved = NULL;
+dir_entry *txn_dir = NULL;
+int *txn_blocks = NULL;
+int txn_clusters = 0;
+int txn_seq = 0;
+int txn_copies = 0;
+
+/* A handle is its slot in the low bits and the slot generation above them,
+   so a handle that was closed never matches the slot again. */
+#define SLOT_BITS 16
+#define MAX_SLOTS (1 << SLOT_BITS)
+
+/* Buffer cache slot, holds one cluster. Slots are kept in a LRU list
+   (head is the most recently used) and in a hash chain keyed by cluster. */
+typedef struct {
+	int block;
+	char dirty;
+	char prefetched;
+	int prev, next;
+	int hash_next;
+	char *data;
+} cache_slot;
+
+cache_slot *cache = NULL;
+int cache_size = 0;
+int cache_cluster = 0;
+int *cache_hash = NULL;
+int cache_buckets = 0;
+int lru_head = -1, lru_tail = -1;
+
+/* Cache statistics */
+long cache_hits = 0, cache_misses = 0;
+long ra_clusters = 0, ra_hits = 0;
+
+/* Asynchronous requests: one fs_aio per fs_read_async/fs_write_async call, from
+   submission until fs_aio_wait. batch gathers its cluster runs so they reach the
+   disk queue together, pending counts the runs still in flight. */
+#define AIO_SLOTS 1024
 
-/* Incremental ID variable for opened files. */
-int id = 0;
+typedef struct {
+	char busy;
+	char failed;
+	int bytes;
+	int pending;
+	bl_request **batch;
+	int batch_len;
+	int batch_cap;
+} fs_aio;
+
+/* A cluster run handed to the disk queue */
+typedef struct {
+	bl_request req;
+	struct iovec iov;
+	int aio;
+} aio_run;
+
+fs_aio aio_list[AIO_SLOTS];
+int aio_hint = 0;
+bl_queue *aio_queue = NULL;
+int aio_reaping = 0;
+
+/* Locking, always taken in this order:
+   dir_lock    the directory array, its name index and dir_hint: read-locked by every
+               call that uses a directory entry, write-locked to create, remove,
+               truncate or format;
+   slot lock   the opened_file of a handle (opened_file.lock);
+   file_locks  the data and cluster chain of a file, striped by directory entry:
+               read-locked to read, write-locked to write;
+   meta_lock   fat[], the free cluster index, dir entry sizes and chains, and the dirty
+               metadata flags (the allocator);
+   table_lock  the free slot list of opened_file_list;
+   cache_lock  the buffer cache;
+   aio_lock    aio_list and the reaping of the disk queue (aio_done signals reaps);
+   index_lock  the start of index_build, see below;
+   pool_lock   the cluster buffer pool. */
+#define FILE_LOCKS 64
+
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t file_locks[FILE_LOCKS];
+pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t aio_done = PTHREAD_COND_INITIALIZER;
+
+char *pool[POOL_MAX];
+int pool_count = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Indexes built after mounting by index_build, index_lock and index_cond only
+   tell fs_init that it holds the locks. Times of the last mount, in microseconds. */
+int index_started = 0;
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t index_cond = PTHREAD_COND_INITIALIZER;
+long mount_us = 0, index_us = -1;
 
 /* Read blocks */
 int read_block(char *sectorBuffer, int sector);
@@ -72,151 +368,1009 @@ int read_block(char *sectorBuffer, int sector);
 /* Write blocks */
 int write_block(char *sectorBuffer, int sector);
 
+/* Metadata journal */
+static void txn_end();
+static int flush_home();
+static int log_commit();
+static int log_open();
+static int log_replay(int pass);
+static int log_start();
+static int log_checkpoint();
+static void log_clear();
+
+/* Cluster buffers aligned for direct I/O */
+static char *buf_alloc(size_t bytes);
+static char *buf_get();
+static void buf_put(char *buffer);
+static void pool_drain();
+
+/* Buffer cache lookups */
+static int cache_find(int block);
+static void cache_unhash(int s);
+static void cache_prefetch(int *blocks, int count);
+static void cache_invalidate(int block, int count);
+static int cache_writeback(int block, int count);
+static int cache_replace(int clusters);
+static void cache_drop();
+
+/* Read/write runs of contiguous blocks straight from/to the caller's buffer,
+   queued on asynchronous request aio unless it is -1 */
+static int read_run(char *buffer, int block, int count, int aio);
+static int write_run(char *buffer, int block, int count, int aio);
+
+/* Read/write part of a block, in place when the image is in memory */
+static int read_part(char *buffer, int block, int offset, int count, char *aux);
+static int write_part(char *buffer, int block, int offset, int count, int fresh, char *aux);
+
+/* txn_save: Adds the value FAT entry i had before the open transaction changed it
+	to the undo log. */
+static void txn_save(int i) {
+	txn_record *undo;
+	int cap;
+
+	txn_saved[i/64] |= 1UL << (i%64);
+	if (txn_undo_len == -1) return;
+	if (txn_undo_len == txn_undo_cap) {
+		cap = txn_undo_cap ? 2*txn_undo_cap : 1024;
+		if ((undo = realloc (txn_undo, cap*sizeof(txn_record))) == NULL) {
+			txn_undo_len = -1;
+			return;
+		}
+		txn_undo = undo;
+		txn_undo_cap = cap;
+	}
+	txn_undo[txn_undo_len].index = i;
+	txn_undo[txn_undo_len].value = fat[i];
+	txn_undo_len++;
+}
+
+/* free_hold: Keeps freed cluster i out of the allocator until free_release. Short of
+	memory to remember it, the cluster is free at once. */
+static void free_hold(int i) {
+	int cap, *held;
+
+	if (free_held_len == free_held_cap) {
+		cap = free_held_cap ? 2*free_held_cap : 1024;
+		if ((held = realloc (free_held, cap*sizeof(int))) == NULL) {
+			free_map[i/64] |= 1UL << (i%64);
+			free_count++;
+			return;
+		}
+		free_held = held;
+		free_held_cap = cap;
+	}
+	free_held[free_held_len++] = i;
+	free_held_count++;
+}
+
+/* fat_set: Changes a FAT entry, marking the FAT cluster holding it as dirty.
+	Like every function changing the FAT, the free index or the dirty flags,
+	it must be called with meta_lock held. */
+static void fat_set(int i, unsigned int value) {
+	if (txn_active && !(txn_saved[i/64] & (1UL << (i%64))))
+		txn_save(i);
+	if (i >= data_first && i < free_limit && (fat[i] == FAT_FREE) != (value == FAT_FREE)) {
+		if (value == FAT_FREE) {
+			free_hold(i);
+		} else if (free_map[i/64] & (1UL << (i%64))) {
+			free_map[i/64] &= ~(1UL << (i%64));
+			free_count--;
+		} else {
+			free_held_count--;
+		}
+	}
+	fat[i] = value;
+	fat_dirty[i / (cluster_size/sizeof(fat[0]))] = 1;
+	if (log_enabled && !fat_pending[i]) {
+		fat_pending[i] = 1;
+		fat_pending_sec[i / (SECTORSIZE/sizeof(fat[0]))] = 1;
+		log_records++;
+	}
+}
+
+/* geometry: Lays out an image of clusters clusters of size bytes, with a journal of
+	log clusters when it leaves room for as many file clusters, and makes room in
+	memory for its FAT (zeroed, every cluster free) and the indexes kept along. */
+static int geometry(int size, int clusters, int log) {
+	int per_sector = SECTORSIZE/sizeof(fat[0]);
+
+	if (size != cluster_size) pool_drain();
+	cluster_size = size;
+	cluster_sectors = size/SECTORSIZE;
+	fat_clusters = ((long) clusters*sizeof(fat[0]) + size - 1) / size;
+	dir_first = 1 + fat_clusters;
+	log_first = dir_first + 1;
+	log_clusters = (clusters >= log_first + 2*log) ? log : 0;
+	log_sectors = log_clusters*cluster_sectors;
+	data_first = log_first + log_clusters;
+	free_limit = clusters;
+	fat_sectors = (clusters + per_sector - 1) / per_sector;
+
+	if (fat_mapped) bl_unmap(fat, fat_mapped);
+	else free(fat);
+	fat_mapped = 0;
+	free(fat_dirty);
+	free(fat_pending);
+	free(fat_pending_sec);
+	free(free_map);
+	fat = calloc (fat_clusters, size);
+	fat_dirty = calloc (fat_clusters, 1);
+	fat_pending = calloc (fat_sectors, per_sector);
+	fat_pending_sec = calloc (fat_sectors, 1);
+	free_map = calloc ((clusters + 63)/64, sizeof(unsigned long));
+	return fat != NULL && fat_dirty != NULL && fat_pending != NULL &&
+			fat_pending_sec != NULL && free_map != NULL;
+}
+
+/* free_part_build: Fills the free cluster index for the clusters of part, whose bounds
+	are multiples of 64 (but for the last) so no other part shares its words. */
+static void *free_part_build(void *arg) {
+	free_part *part = arg;
+	int i;
+
+	part->count = 0;
+	for (i = part->from > data_first ? part->from : data_first; i < part->to; i++) {
+		if (fat[i] == FAT_FREE) {
+			free_map[i/64] |= 1UL << (i%64);
+			part->count++;
+		}
+	}
+	return NULL;
+}
+
+/* fat_map: Swaps the zeroed FAT of the current geometry for a mapping of the one in the
+	image. Returns 0 when the image can't be mapped and the FAT has to be read. The mapping
+	is private even when the image is in memory (bl_ptr): FAT changes may only reach the
+	image after the journal committed them. */
+static int fat_map() {
+	unsigned int *mapped = bl_map(cluster_sectors, (size_t) fat_clusters*cluster_size);
+
+	if (mapped == NULL) return 0;
+	free(fat);
+	fat = mapped;
+	fat_mapped = (size_t) fat_clusters*cluster_size;
+	return 1;
+}
+
+/* free_rebuild: Builds the free cluster index from the FAT, a part of FREE_SLICE
+	clusters or more per thread, up to FREE_THREADS. On a mapped FAT the threads
+	also read its clusters from the image in parallel. */
+static void free_rebuild() {
+	pthread_t threads[FREE_THREADS];
+	free_part parts[FREE_THREADS];
+	int started[FREE_THREADS];
+	int i, n, step;
+
+	memset (free_map, 0, (free_limit + 63)/64*sizeof(unsigned long));
+	free_held_len = free_held_count = 0;
+	n = free_limit/FREE_SLICE + 1;
+	if (n > FREE_THREADS) n = FREE_THREADS;
+	step = (free_limit/n + 63) / 64 * 64;
+
+	for (i = 0; i < n; i++) {
+		parts[i].from = i*step;
+		parts[i].to = (i == n - 1) ? free_limit : (i + 1)*step;
+		started[i] = i > 0 && pthread_create(&threads[i], NULL, free_part_build, &parts[i]) == 0;
+	}
+	free_count = 0;
+	for (i = 0; i < n; i++) {
+		if (started[i]) pthread_join(threads[i], NULL);
+		else free_part_build(&parts[i]);
+		free_count += parts[i].count;
+	}
+}
+
+/* free_release: Hands the held clusters to the allocator, their frees are on disk now.
+	The disk is flushed first, so nothing written to them by a new owner gets there
+	before the frees do. Clusters taken back meanwhile (by fs_abort) stay out. */
+static void free_release() {
+	int k, i;
+
+	if (free_held_len == 0 || !bl_flush()) return;
+	for (k = 0; k < free_held_len; k++) {
+		i = free_held[k];
+		if (fat[i] == FAT_FREE && !(free_map[i/64] & (1UL << (i%64)))) {
+			free_map[i/64] |= 1UL << (i%64);
+			free_count++;
+		}
+	}
+	free_held_len = free_held_count = 0;
+}
+
+/* free_settle: Commits the pending changes when fewer than need clusters are free and
+	some are held, so those can be used. Returns the number of free clusters. A
+	transaction holds its frees until fs_commit. */
+static int free_settle(int need) {
+	if (free_count < need && free_held_count > 0 && !txn_active) {
+		if (log_enabled) log_commit();
+		else flush_home();
+	}
+	return free_count;
+}
+
+/* free_find: Returns the first free cluster at or after from, wrapping
+	around to the start of the data area, or -1 if the disk is full. */
+static int free_find(int from) {
+	int w, words = (free_limit + 63)/64;
+	unsigned long bits;
+
+	if (free_count == 0) return -1;
+	if (from < data_first || from >= free_limit) from = data_first;
+
+	/* Word at from, ignoring the bits before it */
+	bits = free_map[from/64] & (~0UL << (from%64));
+	for (w = from/64; ; ) {
+		if (bits) return w*64 + __builtin_ctzl(bits);
+		if (++w == words) w = 0;
+		bits = free_map[w];
+		if (w == from/64) break;
+	}
+	/* Back to the first word, only the bits before from are left */
+	bits &= ~(~0UL << (from%64));
+	return bits ? w*64 + __builtin_ctzl(bits) : -1;
+}
+
+/* free_scan: Returns the first cluster at or after from that is free
+	(or used, when free is 0), or free_limit if there is none. */
+static int free_scan(int from, int free) {
+	int w;
+	unsigned long bits;
+
+	if (from >= free_limit) return free_limit;
+	w = from/64;
+	bits = (free ? free_map[w] : ~free_map[w]) & (~0UL << (from%64));
+	while (!bits) {
+		if (++w >= (free_limit + 63)/64) return free_limit;
+		bits = free ? free_map[w] : ~free_map[w];
+	}
+	from = w*64 + __builtin_ctzl(bits);
+	return from < free_limit ? from : free_limit;
+}
+
+/* free_extent: Best-fit search for a run of want free clusters. Returns the
+	first cluster of the smallest run that holds want clusters or, if there
+	is none, of the largest run; *len receives the usable length. */
+static int free_extent(int want, int *len) {
+	int i, j, best = -1, best_len = 0;
+
+	for (i = free_scan(data_first, 1); i < free_limit; i = free_scan(j, 1)) {
+		j = free_scan(i, 0);
+		if (j - i >= want) {
+			if (best_len < want || j - i < best_len) {
+				best = i;
+				best_len = j - i;
+				if (best_len == want) break;
+			}
+		} else if (j - i > best_len) {
+			best = i;
+			best_len = j - i;
+		}
+	}
+
+	*len = best_len < want ? best_len : want;
+	return best;
+}
+
+/* chain_free: Frees the chain of clusters from block. Each run of consecutive clusters
+	is dropped from the cache, a dirty slot written back later would land on the data
+	of the cluster's next owner. */
+static void chain_free(int block) {
+	int start, next;
+
+	for (start = block; block != FAT_EOF; block = next) {
+		next = fat[block];
+		fat_set(block, FAT_FREE);
+		if (next != block + 1) {
+			cache_invalidate(start, block - start + 1);
+			start = next;
+		}
+	}
+}
+
+/* dir_touch: Marks directory entry i as changed. */
+static void dir_touch(int i) {
+	dir_dirty[i] = 1;
+	if (i < dir_dirty_lo) dir_dirty_lo = i;
+	if (i > dir_dirty_hi) dir_dirty_hi = i;
+	if (log_enabled && !dir_pending[i]) {
+		dir_pending[i] = 1;
+		if (i < dir_pending_lo) dir_pending_lo = i;
+		if (i > dir_pending_hi) dir_pending_hi = i;
+		log_records++;
+	}
+}
+
+/* dir_busy: Tells whether directory entry i has open handles, so it can't be removed or
+	truncated. The directory must be write-locked. */
+static int dir_busy(int i) {
+	if (dir_opened[i] == 0) return 0;
+	printf("File is open.");
+	return 1;
+}
+
+/* append_block: Returns the cluster following block, the last one written
+	in a file. Clusters reserved by fs_fallocate are already chained, otherwise
+	a free cluster is linked, searching right after block so files stay contiguous.
+	Anything else in the FAT entry is not a data cluster and is reported as corruption. */
+static int append_block(int block) {
+	int i;
+
+	if (fat[block] != FAT_EOF) {
+		if (fat[block] >= (unsigned int) data_first && fat[block] < (unsigned int) free_limit)
+			return fat[block];
+		printf("Cluster chain is corrupted!\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&meta_lock);
+	free_settle(1);
+	i = free_find(block + 1);
+	if (i != -1) {
+		fat_set(block, i);
+		fat_set(i, FAT_EOF);
+	}
+	pthread_mutex_unlock(&meta_lock);
+
+	if (i == -1) printf("Disk is full!\n");
+	return i;
+}
+
+/* name_hash: FNV-1a hash of a file name. */
+static unsigned int name_hash(const char *name) {
+	unsigned int h = 2166136261u;
+
+	while (*name) {
+		h ^= (unsigned char) *name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* dir_lookup: Returns the directory entry of the file named name, or -1. */
+static int dir_lookup(const char *name) {
+	unsigned int h;
+
+	for (h = name_hash(name) & (name_buckets-1); name_table[h] != -1; h = (h + 1) & (name_buckets-1))
+		if (!strcmp (dir[name_table[h]].name, name)) return name_table[h];
+	return -1;
+}
+
+/* name_insert: Puts directory entry i in the name index. */
+static void name_insert(int i) {
+	unsigned int h;
+
+	for (h = name_hash(dir[i].name) & (name_buckets-1); name_table[h] != -1; h = (h + 1) & (name_buckets-1));
+	name_table[h] = i;
+}
+
+/* dir_index_build: Builds the name index from the directory with at least buckets slots. */
+static int dir_index_build(int buckets) {
+	int i, *table;
+
+	/* At most half full, so probe sequences stay short */
+	for (i = 256; i < buckets || i < 2*dir_used; i <<= 1);
+	if (i != name_buckets) {
+		if ((table = realloc (name_table, i*sizeof(int))) == NULL) return 0;
+		name_table = table;
+		name_buckets = i;
+	}
+	for (i = 0; i < name_buckets; i++)
+		name_table[i] = -1;
+	for (i = 0; i < dir_entries; i++)
+		if (dir[i].used == 1) name_insert(i);
+	return 1;
+}
+
+/* dir_index_add: Adds directory entry i to the name index, growing it when half full. */
+static int dir_index_add(int i) {
+	if (2*(dir_used + 1) > name_buckets && !dir_index_build(2*name_buckets)) return 0;
+	name_insert(i);
+	dir_used++;
+	return 1;
+}
+
+/* dir_index_remove: Removes directory entry i from the name index, moving back
+	the entries after it that would otherwise become unreachable. */
+static void dir_index_remove(int i) {
+	unsigned int h, j, home;
+
+	for (h = name_hash(dir[i].name) & (name_buckets-1); name_table[h] != i; h = (h + 1) & (name_buckets-1))
+		if (name_table[h] == -1) return;
+	dir_used--;
+
+	for (j = (h + 1) & (name_buckets-1); name_table[j] != -1; j = (j + 1) & (name_buckets-1)) {
+		home = name_hash(dir[name_table[j]].name) & (name_buckets-1);
+		/* entry j may fill the hole at h unless its home lies in (h, j] */
+		if (((j - home) & (name_buckets-1)) >= ((j - h) & (name_buckets-1))) {
+			name_table[h] = name_table[j];
+			h = j;
+		}
+	}
+	name_table[h] = -1;
+}
+
+/* dir_index_rebuild: Builds the name index from the directory. */
+static int dir_index_rebuild() {
+	int i;
+
+	for (dir_used = 0, i = 0; i < dir_entries; i++)
+		if (dir[i].used == 1) dir_used++;
+	dir_hint = 0;
+	return dir_index_build(0);
+}
+
+/* dir_resize: Makes room in memory for a directory of the given number of clusters. */
+static int dir_resize(int clusters) {
+	dir_entry *entries;
+	char *dirty;
+	int *blocks, *gen, *life, *writes, *opened;
+
+	if ((entries = realloc (dir, clusters*cluster_size)) == NULL) return 0;
+	dir = entries;
+	if ((dirty = realloc (dir_dirty, clusters*DIR_PER_BLOCK)) == NULL) return 0;
+	dir_dirty = dirty;
+	if ((dirty = realloc (dir_pending, clusters*DIR_PER_BLOCK)) == NULL) return 0;
+	dir_pending = dirty;
+	if ((blocks = realloc (dir_blocks, clusters*sizeof(int))) == NULL) return 0;
+	dir_blocks = blocks;
+	if ((gen = realloc (dir_gen, clusters*DIR_PER_BLOCK*sizeof(int))) == NULL) return 0;
+	dir_gen = gen;
+	if ((life = realloc (dir_life, clusters*DIR_PER_BLOCK*sizeof(int))) == NULL) return 0;
+	dir_life = life;
+	if ((writes = realloc (dir_writes, clusters*DIR_PER_BLOCK*sizeof(int))) == NULL) return 0;
+	dir_writes = writes;
+	if ((opened = realloc (dir_opened, clusters*DIR_PER_BLOCK*sizeof(int))) == NULL) return 0;
+	dir_opened = opened;
+
+	if (clusters > dir_clusters) {
+		memset (&dir[dir_entries], 0, (clusters - dir_clusters)*cluster_size);
+		memset (&dir_dirty[dir_entries], 0, (clusters - dir_clusters)*DIR_PER_BLOCK);
+		memset (&dir_pending[dir_entries], 0, (clusters - dir_clusters)*DIR_PER_BLOCK);
+		memset (&dir_gen[dir_entries], 0, (clusters - dir_clusters)*DIR_PER_BLOCK*sizeof(int));
+		memset (&dir_life[dir_entries], 0, (clusters - dir_clusters)*DIR_PER_BLOCK*sizeof(int));
+		memset (&dir_writes[dir_entries], 0, (clusters - dir_clusters)*DIR_PER_BLOCK*sizeof(int));
+		memset (&dir_opened[dir_entries], 0, (clusters - dir_clusters)*DIR_PER_BLOCK*sizeof(int));
+	}
+	dir_clusters = clusters;
+	dir_entries = clusters*DIR_PER_BLOCK;
+	return 1;
+}
+
+/* dir_load: Loads the directory clusters chained after dir_first, which
+	fs_init reads together with the FAT. Each run of contiguous clusters
+	takes a single vectored read. */
+static int dir_load() {
+	struct iovec iov;
+	int c, n, i, j;
+
+	/* Count the chain, a broken one leaves only its first cluster */
+	for (n = 1, c = dir_first; fat[c] != FAT_DIR_END; c = fat[c], n++) {
+		if (fat[c] < (unsigned int) data_first || fat[c] >= free_limit || n > free_limit) {
+			n = 1;
+			break;
+		}
+	}
+	if (!dir_resize(n)) return 0;
+
+	dir_blocks[0] = dir_first;
+	for (i = 1; i < n; i++)
+		dir_blocks[i] = fat[dir_blocks[i-1]];
+
+	for (i = 1; i < n; i = j) {
+		for (j = i + 1; j < n && dir_blocks[j] == dir_blocks[j-1] + 1; j++);
+		iov.iov_base = &dir[i*DIR_PER_BLOCK];
+		iov.iov_len = (j - i)*cluster_size;
+		if (!bl_readv (dir_blocks[i]*cluster_sectors, &iov, 1)) return 0;
+	}
+	return 1;
+}
+
+/* dir_grow: Chains one more cluster of unused entries to the directory. */
+static int dir_grow() {
+	int i, block = free_find(dir_blocks[dir_clusters-1] + 1);
+
+	if (block == -1 || !dir_resize(dir_clusters + 1)) return 0;
+	/* A dirty slot left by the file that freed the cluster would be written
+	   back over the entries */
+	cache_invalidate(block, 1);
+
+	fat_set(dir_blocks[dir_clusters-2], block);
+	fat_set(block, FAT_DIR_END);
+	dir_blocks[dir_clusters-1] = block;
+
+	/* The whole cluster has to reach the disk */
+	for (i = dir_entries - DIR_PER_BLOCK; i < dir_entries; i++)
+		dir_touch(i);
+	return 1;
+}
+
+/* handle_take: Resolves handle file to its opened_file_list slot, leaving the
+	directory read-locked, the slot locked and the file locked for reading or,
+	in write mode, writing. A handle on an older lifetime of its directory entry
+	is only taken if stale is set. Returns the slot, or -1 with nothing locked. */
+static int handle_take(int file, int stale) {
+	int slot = file & (MAX_SLOTS-1);
+	opened_file *f;
+
+	if (file < 0 || slot >= __atomic_load_n(&opened_slots, __ATOMIC_ACQUIRE)) return -1;
+	f = opened_file_list[slot];
+
+	pthread_rwlock_rdlock(&dir_lock);
+	pthread_mutex_lock(&f->lock);
+	if (f->id != file) {
+		pthread_mutex_unlock(&f->lock);
+		pthread_rwlock_unlock(&dir_lock);
+		return -1;
+	}
+	if (f->mode == FS_W) {
+		pthread_rwlock_wrlock(&file_locks[f->index % FILE_LOCKS]);
+		dir_writes[f->index]++;
+	} else {
+		pthread_rwlock_rdlock(&file_locks[f->index % FILE_LOCKS]);
+	}
+
+	/* The entry was removed under the handle, its clusters are not the file's anymore */
+	if (!stale && f->life != dir_life[f->index]) {
+		pthread_rwlock_unlock(&file_locks[f->index % FILE_LOCKS]);
+		pthread_mutex_unlock(&f->lock);
+		pthread_rwlock_unlock(&dir_lock);
+		return -1;
+	}
+	return slot;
+}
+
+/* handle_lock: handle_take for a handle on a live directory entry. */
+static int handle_lock(int file) {
+	return handle_take(file, 0);
+}
+
+/* handle_unlock: Releases what handle_lock took. */
+static void handle_unlock(int slot) {
+	opened_file *f = opened_file_list[slot];
+
+	pthread_rwlock_unlock(&file_locks[f->index % FILE_LOCKS]);
+	pthread_mutex_unlock(&f->lock);
+	pthread_rwlock_unlock(&dir_lock);
+}
+
+/* opened_alloc: Takes a closed slot, growing the table when there is none,
+	and gives it a new handle. Returns the slot or -1. */
+static int opened_alloc() {
+	int i, slots, slot;
+
+	pthread_mutex_lock(&table_lock);
+	if (opened_file_list == NULL)
+		opened_file_list = calloc (MAX_SLOTS, sizeof(opened_file *));
+
+	if (free_slot == -1 && opened_file_list != NULL) {
+		slots = opened_slots ? 2*opened_slots : 128;
+		if (slots > MAX_SLOTS) slots = MAX_SLOTS;
+
+		for (i = opened_slots; i < slots; i++) {
+			if ((opened_file_list[i] = calloc (1, sizeof(opened_file))) == NULL) break;
+			pthread_mutex_init(&opened_file_list[i]->lock, NULL);
+			opened_file_list[i]->id = -1;
+			opened_file_list[i]->next_free = free_slot;
+			free_slot = i;
+		}
+		__atomic_store_n(&opened_slots, i, __ATOMIC_RELEASE);
+	}
+	if (free_slot == -1) {
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+
+	slot = free_slot;
+	free_slot = opened_file_list[slot]->next_free;
+	pthread_mutex_unlock(&table_lock);
+
+	/* Generations wrap before the handle would turn negative */
+	pthread_mutex_lock(&opened_file_list[slot]->lock);
+	opened_file_list[slot]->gen = (opened_file_list[slot]->gen + 1) & ((1 << (30 - SLOT_BITS)) - 1);
+	if (opened_file_list[slot]->gen == 0) opened_file_list[slot]->gen = 1;
+	opened_file_list[slot]->id = (opened_file_list[slot]->gen << SLOT_BITS) | slot;
+	pthread_mutex_unlock(&opened_file_list[slot]->lock);
+	return slot;
+}
+
+/* map_block: Returns the block holding the n-th cluster of opened file id, or -1
+	past the end of the chain. The map is extended walking the FAT from its last entry. */
+static int map_block(int id, int n) {
+	opened_file *f = opened_file_list[id];
+	unsigned int *map;
+	int cap;
+
+	/* The chain changed since the map was built */
+	if (f->map_gen != dir_gen[f->index]) {
+		f->map_gen = dir_gen[f->index];
+		f->map_len = 0;
+	}
+
+	if (n < f->map_len) return f->map[n];
+
+	if (n >= f->map_cap) {
+		for (cap = f->map_cap ? f->map_cap : 64; cap <= n; cap *= 2);
+		if ((map = realloc (f->map, cap*sizeof(unsigned int))) == NULL) return -1;
+		f->map = map;
+		f->map_cap = cap;
+	}
+	if (f->map_len == 0) {
+		f->map[0] = dir[f->index].first_block;
+		f->map_len = 1;
+	}
+	while (f->map_len <= n) {
+		if (fat[f->map[f->map_len-1]] == FAT_EOF) return -1;
+		f->map[f->map_len] = fat[f->map[f->map_len-1]];
+		f->map_len++;
+	}
+	return f->map[n];
+}
+
+/* map_drop: Invalidates the cluster maps of every handle on directory entry index,
+	used when its chain is freed or moved. */
+static void map_drop(int index) {
+	dir_gen[index]++;
+}
+
+/* elapsed_us: Microseconds since start. */
+static long elapsed_us(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)*1000000L + (now.tv_nsec - start->tv_nsec)/1000;
+}
+
+/* index_build: Builds the name index and the free cluster index of a mounted image.
+	fs_init waits until it holds dir_lock and meta_lock, dir_lock is released once
+	the name index is ready and meta_lock once the free cluster index is. */
+static void *index_build(void *arg) {
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_rwlock_wrlock(&dir_lock);
+	pthread_mutex_lock(&meta_lock);
+	if (arg != NULL) {
+		pthread_mutex_lock(&index_lock);
+		index_started = 1;
+		pthread_cond_signal(&index_cond);
+		pthread_mutex_unlock(&index_lock);
+	}
+
+	if (!dir_index_rebuild()) printf ("Failure indexing the directory!\n");
+	pthread_rwlock_unlock(&dir_lock);
+
+	free_rebuild();
+	__atomic_store_n(&index_us, elapsed_us(&start), __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&meta_lock);
+	return NULL;
+}
+
 /*
 	fs_init: Function responsible to initialize the RSFS.
 */
 	int fs_init() {
-		int i;
-		char *fatBuffer = (char *) fat;
+		int i, journal, formatted, replayed = 0;
+		struct iovec iov[2];
+		struct timespec start;
+		pthread_t thread;
+		char super[SECTORSIZE];
+		fs_super sb;
+		static int locks_ready = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!locks_ready) {
+			for (i = 0; i < FILE_LOCKS; i++)
+				pthread_rwlock_init(&file_locks[i], NULL);
+			locks_ready = 1;
+		}
 
-  		/* Loads the FAT to the memory, starting from cluster 0 up to 31, 
-  			the value is multiplied by 8 to obtain the value in sectors */
-		for (i = 0; i < (32*8); i++) { 
+		/* The indexes of the previous mount may still be building, meta_lock is free once they are */
+		pthread_mutex_lock(&meta_lock);
+		pthread_mutex_unlock(&meta_lock);
 
-			if (!bl_read (i, &fatBuffer[SECTORSIZE*i])) {
-				printf ("Failure loading the FAT system!\n");
-				return 0;
-			}        
+		/* The superblock gives the geometry. An image without a valid one gets the
+			smallest clusters and an empty FAT, which checkdisk reports as unformatted */
+		if (!bl_read (0, super)) {
+			printf ("Failure loading the superblock!\n");
+			return 0;
+		}
+		memcpy (&sb, super, sizeof(sb));
+		formatted = sb.magic == FS_MAGIC && sb.version == FS_VERSION &&
+				sb.cluster_size >= CLUSTER_MIN && sb.cluster_size <= CLUSTER_MAX &&
+				(sb.cluster_size & (sb.cluster_size - 1)) == 0 && sb.clusters > 0 &&
+				sb.clusters <= (unsigned int) bl_size() / (sb.cluster_size/SECTORSIZE);
+		if (formatted && (!geometry(sb.cluster_size, sb.clusters, sb.log_clusters) ||
+				(unsigned int) fat_clusters != sb.fat_clusters || (unsigned int) log_clusters != sb.log_clusters))
+			formatted = 0;
+		if (!formatted && !geometry(CLUSTER_MIN, bl_size() / (CLUSTER_MIN/SECTORSIZE), 0)) {
+			printf ("Failure allocating the FAT!\n");
+			return 0;
 		}
 
-  		/* Loading directory to memory */
-		if(!read_block ((char *) dir, 32)) {
-			printf ("Failure loading the directory!\n");
+		dir_clusters = dir_entries = 0;
+		if (!dir_resize(1)) {
+			printf ("Failure allocating the directory!\n");
+			return 0;
+		}
+
+  		/* Maps the FAT (clusters 1 up to dir_first - 1), so mounting doesn't read it, and
+  			loads the first directory cluster. Without the mapping both are read, they
+  			are contiguous so a single vectored read does it */
+		iov[0].iov_base = fat;
+		iov[0].iov_len = (size_t) fat_clusters*cluster_size;
+		iov[1].iov_base = dir;
+		iov[1].iov_len = cluster_size;
+
+		if (formatted && (fat_map() ? !bl_readv (dir_first*cluster_sectors, &iov[1], 1) :
+				!bl_readv (cluster_sectors, iov, 2))) {
+			printf ("Failure loading the FAT system and directory!\n");
 			return 0;
 		}
 
   		/* Initialize opened file list, -1 = closed file */
-		for (i = 0; i < 128; i++) {
-			opened_file_list[i].id = -1;
-			opened_file_list[i].counter = 0;
+		free_slot = -1;
+		for (i = opened_slots - 1; i >= 0; i--) {
+			free(opened_file_list[i]->map);
+			opened_file_list[i]->id = -1;
+			opened_file_list[i]->counter = 0;
+			opened_file_list[i]->map = NULL;
+			opened_file_list[i]->map_len = opened_file_list[i]->map_cap = 0;
+			opened_file_list[i]->next_free = free_slot;
+			free_slot = i;
+		}
+
+		/* Metadata committed to the journal but not written home yet goes in first */
+		log_enabled = 0;
+		txn_end();
+		if ((journal = log_open())) replayed = log_replay(0);
+
+		/* The rest of the directory chain, if it grew past its first cluster */
+		if (!dir_load()) {
+			printf ("Failure loading the directory!\n");
+			return 0;
+		}
+		if (replayed) log_replay(1);
+
+		/* Replayed or not, the journal starts over in a new epoch */
+		if (journal) {
+			pthread_mutex_lock(&meta_lock);
+			if (!log_start() || !log_checkpoint()) {
+				pthread_mutex_unlock(&meta_lock);
+				printf ("Failure recovering the journal!\n");
+				return 0;
+			}
+			pthread_mutex_unlock(&meta_lock);
+			if (replayed) printf ("Journal: replayed %d commit blocks.\n", replayed);
+		}
+
+		/* Clusters cached for an image of another cluster size can't go back to the disk */
+		if (cache != NULL && cache_cluster != cluster_size) cache_drop();
+		if ((cache == NULL || cache_cluster != cluster_size) && !fs_cache(CACHE_CLUSTERS)) {
+			printf ("Failure allocating the buffer cache!\n");
+			return 0;
 		}
 
 		checkdisk();
 
+		/* The name and free cluster indexes are built in the background, calls that need
+			them wait for the locks index_build holds meanwhile */
+		__atomic_store_n(&index_us, -1, __ATOMIC_RELAXED);
+		if (pthread_create(&thread, NULL, index_build, &index_started) == 0) {
+			pthread_detach(thread);
+			pthread_mutex_lock(&index_lock);
+			while (!index_started)
+				pthread_cond_wait(&index_cond, &index_lock);
+			index_started = 0;
+			pthread_mutex_unlock(&index_lock);
+		} else {
+			index_build(NULL);
+		}
+
+		mount_us = elapsed_us(&start);
 		return 1;
 	}
 
+/* fs_mount_stats: Reports how long the last fs_init took and how long building the indexes
+	took after it (-1 while they are still building). */
+	void fs_mount_stats(long *mount, long *index) {
+		*mount = mount_us;
+		*index = __atomic_load_n(&index_us, __ATOMIC_RELAXED);
+	}
+
 /* checkdisk - function responsible for verifying the disk integrity, 
 	allocation table and root directory. */
 	int checkdisk(){
-		int i;
+		int i, n;
 
-  		/* Verify if FAT is mapped correctly on disk */
-		for (i = 0; i < 32; i++) { 
-			if (fat[i] != 3) {
+  		/* Verify if FAT is mapped correctly on disk, superblock included */
+		for (i = 0; i < dir_first; i++) { 
+			if (fat[i] != FAT_SYSTEM) {
 				printf("Warning: Disk is not formatted.\n");
 				return 0;
 			}
 		}
 
-  		/* Verify if directory is mapped on disk */
-		if (fat[32] != 4){ 
-			printf("Warning: Disk image contains compromised directory!\n");
-			return 0;
+  		/* Verify if directory is mapped on disk, a chain from dir_first ended by FAT_DIR_END */
+		for (n = 0, i = dir_first; fat[i] != FAT_DIR_END; i = fat[i], n++) {
+			if (fat[i] < (unsigned int) data_first || fat[i] >= free_limit || n > free_limit) {
+				printf("Warning: Disk image contains compromised directory!\n");
+				return 0;
+			}
 		}
 		return 1;
 	}
 
-/* fs_format: Function responsible for formatting the disk */
-	int fs_format(){
-		int i;
+/* fs_format: Function responsible for formatting the disk with clusters of size bytes
+	(CLUSTER_MIN when size is 0), written down in the superblock. */
+	int fs_format(int size){
+		struct iovec iov;
+		char super[SECTORSIZE];
+		fs_super sb;
+		int i, clusters, formatted;
+
+		if (size == 0) size = CLUSTER_MIN;
+		if (size < CLUSTER_MIN || size > CLUSTER_MAX || (size & (size - 1))) {
+			printf ("Cluster size must be a power of two from %d to %d bytes.\n", CLUSTER_MIN, CLUSTER_MAX);
+			return 0;
+		}
+		clusters = bl_size() / (size/SECTORSIZE);
+
+		pthread_rwlock_wrlock(&dir_lock);
+		for (i = 0; i < __atomic_load_n(&opened_slots, __ATOMIC_ACQUIRE); i++) {
+			if (opened_file_list[i]->id != -1) {
+				pthread_rwlock_unlock(&dir_lock);
+				printf ("Close the open files first.\n");
+				return 0;
+			}
+		}
+		pthread_mutex_lock(&meta_lock);
 
 		checkdisk();
 
 		printf("Formatting disk.\n");
+		log_enabled = 0;
+		txn_end();
+
+  		/* Cached clusters belong to files that no longer exist, and may be of another size */
+		pthread_mutex_lock(&cache_lock);
+		cache_drop();
+		pthread_mutex_unlock(&cache_lock);
+
+  		/* Journal region after the first directory cluster, if the disk has room to spare */
+		if (!geometry(size, clusters, LOG_BYTES/size > 0 ? LOG_BYTES/size : 1) ||
+				clusters <= data_first || (cache_cluster != size && !cache_replace(CACHE_CLUSTERS))) {
+			pthread_mutex_unlock(&meta_lock);
+			pthread_rwlock_unlock(&dir_lock);
+			printf ("Failure formatting the disk!\n");
+			return 0;
+		}
 
-  		/* Reserving space for FAT and directory */
-		for(i = 0; i < 32; i++)
-			fat[i] = 3;
+  		/* Reserving space for the superblock, FAT and directory */
+		for(i = 0; i < dir_first; i++)
+			fat_set(i, FAT_SYSTEM);
 
-		fat[32] = 4;
+		fat_set(dir_first, FAT_DIR_END);
 
-  		/* Rest of FAT initialized with 1, indicating free space */
-		for (i = 33; i < 65536; i++)
-			fat[i] = 1;
+  		/* Rest of FAT initialized with FAT_FREE, indicating free space */
+		for (i = dir_first + 1; i < clusters; i++)
+			fat_set(i, FAT_FREE);
 
-  		/* All directory entries initalized as non-used. */
-		for (i = 0; i < 128; i++){
+		for (i = log_first; i < log_first + log_clusters; i++)
+			fat_set(i, LOG_MARK);
+
+  		/* All directory entries initalized as non-used, back to a single cluster. */
+		dir_clusters = dir_entries = 0;
+		dir_resize(1);
+		dir_blocks[0] = dir_first;
+		for (i = 0; i < dir_entries; i++){
 			dir[i].used = 0;
 			strcpy(dir[i].name,"");
 			dir[i].first_block=-1;
 			dir[i].size=0;
+			dir_touch(i);
 		}
 
-		update();
-		return 1;
+		free_rebuild();
+		dir_index_rebuild();
+
+		memset (super, 0, sizeof(super));
+		sb.magic = FS_MAGIC;
+		sb.version = FS_VERSION;
+		sb.cluster_size = cluster_size;
+		sb.clusters = clusters;
+		sb.fat_clusters = fat_clusters;
+		sb.log_clusters = log_clusters;
+		memcpy (super, &sb, sizeof(sb));
+		formatted = bl_write (0, super);
+
+  		/* Blocks of an older journal in the region must never replay */
+		if (formatted && log_clusters > 0 && log_start()) {
+			memset (log_buf, 0, log_sectors*SECTORSIZE);
+			iov.iov_base = log_buf;
+			iov.iov_len = log_sectors*SECTORSIZE;
+			formatted = bl_writev (log_first*cluster_sectors, &iov, 1);
+		}
+		log_clear();
+		pthread_mutex_unlock(&meta_lock);
+
+		/* The new FAT and directory go home */
+		formatted = formatted && checkpoint();
+		pthread_rwlock_unlock(&dir_lock);
+		if (!formatted) printf ("Failure formatting the disk!\n");
+		return formatted;
 	}
 
 /* fs_free: Funtion responsbile for counting the free space on disk. */
-	int fs_free() {
-		int i, count = 0;
+	long fs_free() {
+		long count;
 
-		for (i = 33; i < (bl_size()/8); i++) {
-			if (fat[i] == 1) count++;
-		}
+		pthread_mutex_lock(&meta_lock);
+		count = free_count + free_held_count;
+		pthread_mutex_unlock(&meta_lock);
 
-		return count * CLUSTERSIZE; 
+		return count * cluster_size; 
 	}
 
 /* fs_list: Function responsible for listing all files. */
 	int fs_list(char *buffer, int size) {
-		int i;
+		int i, n, listed = 1;
 
 		strcpy (buffer,"");
 
-		for (i = 0; i < 128; i++) {
+		pthread_rwlock_rdlock(&dir_lock);
+
+		for (i = 0; i < dir_entries; i++) {
 			if (dir[i].used == 1) {
-				buffer += sprintf (buffer, "%s\t\t%d\n", dir[i].name, dir[i].size);
+				n = snprintf (buffer, size, "%s\t\t%d\n", dir[i].name, dir[i].size);
+				/* Buffer is too small for the whole list */
+				if (n >= size) {
+					listed = 0;
+					break;
+				}
+				buffer += n;
+				size -= n;
 			}
 		}
 
-		return 1;
+		pthread_rwlock_unlock(&dir_lock);
+		return listed;
 	}
 
-/* fs_create: Function responsible for creating a file. */
-	int fs_create(char* file_name) {
-  		int i, free_entry = -1, free_block = -1;
+/* file_create: Creates a file, the directory must be write-locked. The file gets a cluster of
+	its own, or with first_block other than -1 the chain reserved from there holding size bytes. */
+static int file_create(char* file_name, int first_block, int size) {
+  		int free_entry, free_block = first_block, need = (first_block == -1) ? 2 : 1;
 
 		checkdisk();
 
-		if (sizeof(file_name) > 24) {
-			printf ("File name can't have more than 24 characters.");
+		if (strlen(file_name) > 22) {
+			printf ("File name can't have more than 22 characters.");
 			return 0;
 		}
 
-		for (i = 0; i < 128; i++) { 
-			if (!strcmp (file_name, dir[i].name) && dir[i].used == 1) {
-				printf ("File already exists!\n");
-				return 0;
-			}
-			if (dir[i].used == 0 && free_entry == -1) {
-				free_entry = i;
-			}
+		if (dir_lookup(file_name) != -1) {
+			printf ("File already exists!\n");
+			return 0;
 		}
 
-  		if (free_entry == -1) {
+		/* Entries before dir_hint are known to be in use */
+		for (free_entry = dir_hint; free_entry < dir_entries && dir[free_entry].used == 1; free_entry++);
+		dir_hint = free_entry;
+
+		pthread_mutex_lock(&meta_lock);
+
+		/* Every entry is in use, the directory takes one more cluster (and the file another) */
+  		if (free_entry == dir_entries && (free_settle(need) < need || !dir_grow())) {
+			pthread_mutex_unlock(&meta_lock);
 			printf ("Directory is full!\n");
 			return 0;
 		}
 
   		/* Find first free block */
-		for (i = 0; i < (bl_size()/8); i++) {
-			if (fat[i] == 1 && free_block == -1) {
-				free_block = i;
-			}
-		}
+		if (free_block == -1) free_block = free_find(data_first);
 
   		if (free_block == -1) {
+			pthread_mutex_unlock(&meta_lock);
 			printf("Disk is full!\n");
 			return 0;
 		}
@@ -225,391 +1379,2126 @@ int write_block(char *sectorBuffer, int sector);
   		dir[free_entry].used = 1;
  	 	dir[free_entry].first_block = free_block;
 		strcpy(dir[free_entry].name, file_name);
-  		dir[free_entry].size = 0;
+  		dir[free_entry].size = size;
+		dir_touch(free_entry);
+		if (!dir_index_add(free_entry)) {
+			printf ("Failure indexing the directory!\n");
+		}
 
-  		/* Mark block as used by the new file */
-		fat[free_block] = 2;
+  		/* Mark block as used by the new file, a chain given is in use already */
+		if (first_block == -1) fat_set(free_block, FAT_EOF);
+		pthread_mutex_unlock(&meta_lock);
 
 		update();
 		return 1;
 	} 
 
-/* fs_remove: Function responsible for removing a file */
-	int fs_remove(char *file_name) {
+/* fs_create: Function responsible for creating a file. */
+	int fs_create(char* file_name) {
+		int created;
+
+		pthread_rwlock_wrlock(&dir_lock);
+		created = file_create(file_name, -1, 0);
+		pthread_rwlock_unlock(&dir_lock);
+
+		return created;
+	}
+
+/* file_remove: Removes a file, the directory must be write-locked. */
+static int file_remove(char *file_name) {
 		
-		int i, next_block, aux;
+		int i;
   		int first_block = -1;
 
 		checkdisk();
   		
   		/* If file exists, first_block position receives the position stored in the directory. */
-		for (i = 0; i < 128; i++) {
-			if (!strcmp (dir[i].name,file_name) && dir[i].used == 1) {
-				first_block = dir[i].first_block;
-      			
-      			/* Frees name in the directory already. */
-				dir[i].used = 0;
-				strcpy(dir[i].name, "");
-			}
+		pthread_mutex_lock(&meta_lock);
+		if ((i = dir_lookup(file_name)) != -1) {
+			first_block = dir[i].first_block;
+
+			/* Frees name in the directory already. */
+			dir_index_remove(i);
+			dir[i].used = 0;
+			strcpy(dir[i].name, "");
+			dir_touch(i);
+			map_drop(i);
+			dir_life[i]++;
+			if (i < dir_hint) dir_hint = i;
 		}
 
   		if(first_block == -1){
+			pthread_mutex_unlock(&meta_lock);
 			printf("File doesn't exist.");   
 			return 0;
 		}
 
-		/* Solution to remove files with one block or more. Frees current block, 
+		/* Solution to remove files with one block or more. Frees current block,
 			and the next one until it reaches the end of file. */
-		next_block = first_block;
-		while(next_block != 2){
-			aux = fat[next_block];
-			fat[next_block] = 1;
-			next_block = aux;
-		}
+		chain_free(first_block);
+		pthread_mutex_unlock(&meta_lock);
 
 		update();
 		return 1;
 	}
 
-/* fs_open: Function responsible for opening a file. */
-	int fs_open(char *file_name, int mode) {
-		
-  		int i, j, first_block, first_entry;
-  		char file_exists = 0;
-  
-  		checkdisk();
+/* fs_remove: Function responsible for removing a file */
+	int fs_remove(char *file_name) {
+		int i, removed = 0;
 
-  		/* Find file */
-		for (i = 0; i < 128; i++) {
-			if (!strcmp (dir[i].name, file_name)) {
-				first_block=dir[i].first_block;
-				first_entry = i;
-				file_exists=1;
-			}
+		pthread_rwlock_wrlock(&dir_lock);
+		if ((i = dir_lookup(file_name)) == -1 || !dir_busy(i))
+			removed = file_remove(file_name);
+		pthread_rwlock_unlock(&dir_lock);
+
+		return removed;
+	}
+
+/* file_reserve: Links need free clusters into a chain of as few contiguous extents as
+	possible for a file that file_publish creates once it is filled, and lists them in
+	blocks. Returns its first cluster, or -1. *seq tells the transaction it was reserved
+	in (-1 for none), which can't be aborted until the file is published. */
+static int file_reserve(int need, unsigned int *blocks, int *seq) {
+	int i, n, start, len, prev, first = -1;
+
+	pthread_mutex_lock(&meta_lock);
+	if (need > free_settle(need)) {
+		pthread_mutex_unlock(&meta_lock);
+		printf ("Disk is full!\n");
+		return -1;
+	}
+	for (n = 0, prev = -1; n < need; n += len, prev = start + len - 1) {
+		start = free_extent(need - n, &len);
+		if (prev == -1) first = start;
+		else fat_set(prev, start);
+		for (i = 0; i < len; i++) {
+			blocks[n + i] = start + i;
+			fat_set(start + i, (i == len - 1) ? FAT_EOF : start + i + 1);
 		}
-  		
-  		/* Increment id for file that will be opened */
-  		id++;
+	}
+	if (txn_active) txn_copies++;
+	*seq = txn_active ? txn_seq : -1;
+	pthread_mutex_unlock(&meta_lock);
+	return first;
+}
+
+/* file_publish: Creates file name (replacing the old one) on the chain file_reserve made from
+	first, holding size bytes, if filled is set. Otherwise, or when the file can't be created or
+	a transaction that doesn't know the chain opened meanwhile, the chain is freed; such a
+	transaction keeps the free out of its undo log. The directory must be write-locked. */
+static int file_publish(char *name, int first, int size, unsigned int *blocks, int need, int seq, int filled) {
+	int d, k, ours, stale;
+
+	pthread_mutex_lock(&meta_lock);
+	ours = seq != -1 && seq == txn_seq;
+	if (ours) txn_copies--;
+	stale = txn_active && !ours;
+	pthread_mutex_unlock(&meta_lock);
+
+	if (stale) printf ("A transaction was opened meanwhile.\n");
+	if (filled && !stale && ((d = dir_lookup(name)) == -1 || (!dir_busy(d) && file_remove(name))) &&
+			file_create(name, first, size))
+		return 1;
+
+	pthread_mutex_lock(&meta_lock);
+	for (k = 0; k < need && stale; k++)
+		txn_saved[blocks[k]/64] |= 1UL << (blocks[k]%64);
+	chain_free(first);
+	pthread_mutex_unlock(&meta_lock);
+	update();
+	return 0;
+}
+
+/* file_blocks: Lists the first n clusters of directory entry i in blocks. */
+static void file_blocks(int i, int n, unsigned int *blocks) {
+	int k, b;
+
+	for (k = 0, b = dir[i].first_block; k < n; k++, b = fat[b])
+		blocks[k] = b;
+}
+
+/* copy_blocks: Copies clusters from[k] to to[k] for k < n, COPY_CLUSTERS at a time: each batch
+	is read a source run at a time and written a destination run at a time. */
+static int copy_blocks(unsigned int *from, unsigned int *to, int n) {
+	int i, j, k, done, copied = 1;
+	char *buffer;
+
+	if ((buffer = buf_alloc (COPY_CLUSTERS*cluster_size)) == NULL) return 0;
+
+	for (done = 0; done < n && copied; done += COPY_CLUSTERS) {
+		k = n - done < COPY_CLUSTERS ? n - done : COPY_CLUSTERS;
+		for (i = 0; i < k && copied; i = j) {
+			for (j = i + 1; j < k && from[done + j] == from[done + j - 1] + 1; j++);
+			copied = read_run(&buffer[i*cluster_size], from[done + i], j - i, -1);
+		}
+		for (i = 0; i < k && copied; i = j) {
+			for (j = i + 1; j < k && to[done + j] == to[done + j - 1] + 1; j++);
+			copied = write_run(&buffer[i*cluster_size], to[done + i], j - i, -1);
+		}
+	}
+	free(buffer);
+	return copied;
+}
+
+/* fs_copy: Function responsible for copying file src to dst, which is replaced if it exists.
+	The copy gets contiguous extents of its own and the clusters move in runs of up to
+	COPY_CLUSTERS, without going through fs_read/fs_write. Like a move of the defragmenter,
+	the clusters are reserved and filled holding only read locks of the directory and of
+	src, and dst is published under the directory write lock afterwards. */
+	int fs_copy(char *src, char *dst) {
+		int s, d, size, need, seq, first = -1, copied = 0;
+		unsigned int *src_blocks, *dst_blocks;
+
+		pthread_rwlock_rdlock(&dir_lock);
+		if ((s = dir_lookup(src)) == -1) {
+			pthread_rwlock_unlock(&dir_lock);
+			printf ("File doesn't exist.");
+			return 0;
+		}
+		if (!strcmp(src, dst)) {
+			pthread_rwlock_unlock(&dir_lock);
+			return 1;
+		}
+		if ((d = dir_lookup(dst)) != -1 && dir_busy(d)) {
+			pthread_rwlock_unlock(&dir_lock);
+			return 0;
+		}
+
+		pthread_rwlock_rdlock(&file_locks[s % FILE_LOCKS]);
+		size = dir[s].size;
+		need = size > 0 ? (size + cluster_size - 1) / cluster_size : 1;
+		src_blocks = malloc (need*sizeof(unsigned int));
+		dst_blocks = malloc (need*sizeof(unsigned int));
+		if (src_blocks != NULL && dst_blocks != NULL && (first = file_reserve(need, dst_blocks, &seq)) != -1) {
+			file_blocks(s, need, src_blocks);
+			copied = copy_blocks(src_blocks, dst_blocks, need);
+		}
+		pthread_rwlock_unlock(&file_locks[s % FILE_LOCKS]);
+		pthread_rwlock_unlock(&dir_lock);
+
+		if (first != -1) {
+			pthread_rwlock_wrlock(&dir_lock);
+			copied = file_publish(dst, first, size, dst_blocks, need, seq, copied);
+			pthread_rwlock_unlock(&dir_lock);
+		}
+		free(src_blocks);
+		free(dst_blocks);
+		return copied;
+	}
+
+/* fs_import: Function responsible for copying size bytes of host file descriptor host (from its start)
+	into file name, which is replaced if it exists. The clusters are reserved up front and each
+	contiguous run is filled by the kernel straight from the host file, with no lock held, before
+	the file is published under the directory write lock. */
+	int fs_import(char *name, int host, int size) {
+		unsigned int *blocks;
+		int d, i, j, need, seq, first, imported = 1;
+
+		if (size < 0) return 0;
+		need = size > 0 ? (size + cluster_size - 1) / cluster_size : 1;
+		if ((blocks = malloc (need*sizeof(unsigned int))) == NULL) return 0;
+
+		pthread_rwlock_rdlock(&dir_lock);
+		if (((d = dir_lookup(name)) != -1 && dir_busy(d)) || (first = file_reserve(need, blocks, &seq)) == -1) {
+			pthread_rwlock_unlock(&dir_lock);
+			free(blocks);
+			return 0;
+		}
+		pthread_rwlock_unlock(&dir_lock);
+
+		for (i = 0; i < need && size > 0 && imported; i = j) {
+			for (j = i + 1; j < need && blocks[j] == blocks[j-1] + 1; j++);
+			cache_invalidate(blocks[i], j - i);
+			imported = bl_import(blocks[i]*cluster_sectors, host, (off_t) i*cluster_size,
+				(j == need ? size : j*cluster_size) - i*cluster_size);
+		}
+
+		pthread_rwlock_wrlock(&dir_lock);
+		imported = file_publish(name, first, size, blocks, need, seq, imported);
+		pthread_rwlock_unlock(&dir_lock);
+		free(blocks);
+		return imported;
+	}
+
+/* fs_export: Function responsible for copying file name to host file descriptor host (from its start),
+	each contiguous run of clusters moved by the kernel straight from the image. */
+	int fs_export(char *name, int host) {
+		unsigned int *blocks;
+		int i, j, d, need, size, exported = 1;
+
+		pthread_rwlock_rdlock(&dir_lock);
+		if ((d = dir_lookup(name)) == -1) {
+			pthread_rwlock_unlock(&dir_lock);
+			printf ("File doesn't exist.");
+			return 0;
+		}
+		pthread_rwlock_rdlock(&file_locks[d % FILE_LOCKS]);
+		size = dir[d].size;
+		need = (size + cluster_size - 1) / cluster_size;
+
+		if (need > 0 && (blocks = malloc (need*sizeof(unsigned int))) == NULL) {
+			exported = 0;
+		} else if (need > 0) {
+			file_blocks(d, need, blocks);
+			for (i = 0; i < need && exported; i = j) {
+				for (j = i + 1; j < need && blocks[j] == blocks[j-1] + 1; j++);
+				exported = cache_writeback(blocks[i], j - i) &&
+					bl_export(blocks[i]*cluster_sectors, host, (off_t) i*cluster_size,
+						(j == need ? size : j*cluster_size) - i*cluster_size);
+			}
+			free(blocks);
+		}
+
+		pthread_rwlock_unlock(&file_locks[d % FILE_LOCKS]);
+		pthread_rwlock_unlock(&dir_lock);
+		return exported;
+	}
+
+/* file_extents: Returns how many contiguous runs the cluster chain of directory entry i has,
+	and its length in *clusters (clusters reserved past the end of the file included). */
+static int file_extents(int i, int *clusters) {
+	int b, n, extents = 1;
+
+	for (n = 1, b = dir[i].first_block; fat[b] != FAT_EOF && n <= free_limit; n++, b = fat[b])
+		if (fat[b] != b + 1) extents++;
+	*clusters = n;
+	return extents;
+}
+
+/* fs_frag_report: Function responsible for listing the fragmentation of every file: its
+	clusters, extents and score, the share of cluster boundaries that are not contiguous. */
+	int fs_frag_report(char *buffer, int size) {
+		int i, n, clusters, extents, listed = 1;
+
+		strcpy (buffer,"");
+
+		pthread_rwlock_rdlock(&dir_lock);
+
+		for (i = 0; i < dir_entries; i++) {
+			if (dir[i].used == 1) {
+				/* Appends extend the chain under the file lock */
+				pthread_rwlock_rdlock(&file_locks[i % FILE_LOCKS]);
+				extents = file_extents(i, &clusters);
+				pthread_rwlock_unlock(&file_locks[i % FILE_LOCKS]);
+				n = snprintf (buffer, size, "%s\t\t%d\t%d\t%d%%\n", dir[i].name, clusters, extents,
+						clusters > 1 ? (extents - 1)*100 / (clusters - 1) : 0);
+				/* Buffer is too small for the whole list */
+				if (n >= size) {
+					listed = 0;
+					break;
+				}
+				buffer += n;
+				size -= n;
+			}
+		}
+
+		pthread_rwlock_unlock(&dir_lock);
+		return listed;
+	}
+
+/* aio_idle: Returns 1 if no asynchronous request has runs in flight. */
+static int aio_idle() {
+	int i, idle = 1;
+
+	pthread_mutex_lock(&aio_lock);
+	for (i = 0; i < AIO_SLOTS && idle; i++)
+		if (aio_list[i].pending > 0) idle = 0;
+	pthread_mutex_unlock(&aio_lock);
+	return idle;
+}
+
+/* relocate_release: Frees the run of n clusters from start reserved for a move that didn't
+	happen. A batch opened meanwhile keeps it out of its undo log, so an abort leaves it free. */
+static void relocate_release(int start, int n) {
+	int k;
+
+	cache_invalidate(start, n);
+	pthread_mutex_lock(&meta_lock);
+	for (k = 0; k < n; k++) {
+		if (txn_active) txn_saved[(start + k)/64] |= 1UL << ((start + k)%64);
+		fat_set(start + k, FAT_FREE);
+	}
+	pthread_mutex_unlock(&meta_lock);
+}
+
+/* file_relocate: Moves the n clusters of directory entry i to a single free run, if there is
+	one. The run is reserved and filled holding only read locks of the directory and of the
+	file, so other files are read and written meanwhile. The entry is switched over under
+	the directory write lock, unless the file was written, truncated or removed in between.
+	The data is copied before the entry points at the new chain, so a crash in between
+	leaves the old one in place. Open handles are pointed at the same clusters in the new
+	chain. */
+static int file_relocate(int i, int n) {
+	unsigned int *from, *to;
+	int k, j, start = -1, len, gen, writes, copied = 0;
+	opened_file *f;
+
+	from = malloc (n*sizeof(unsigned int));
+	to = malloc (n*sizeof(unsigned int));
+	if (from == NULL || to == NULL) {
+		free(from);
+		free(to);
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&dir_lock);
+	pthread_rwlock_rdlock(&file_locks[i % FILE_LOCKS]);
+	gen = dir_gen[i];
+	writes = dir_writes[i];
+	pthread_mutex_lock(&meta_lock);
+	if (!txn_active && dir[i].used == 1 && file_extents(i, &k) > 1 && k == n) {
+		start = free_extent(n, &len);
+		if (start != -1 && len < n) start = -1;
+		for (k = 0; start != -1 && k < n; k++)
+			fat_set(start + k, (k == n - 1) ? FAT_EOF : start + k + 1);
+	}
+	pthread_mutex_unlock(&meta_lock);
+
+	if (start != -1) {
+		file_blocks(i, n, from);
+		for (k = 0; k < n; k++)
+			to[k] = start + k;
+		copied = copy_blocks(from, to, n);
+	}
+	pthread_rwlock_unlock(&file_locks[i % FILE_LOCKS]);
+	pthread_rwlock_unlock(&dir_lock);
+	if (start == -1) {
+		free(from);
+		free(to);
+		return 0;
+	}
+
+	/* Writes in flight would land on the old clusters */
+	pthread_rwlock_wrlock(&dir_lock);
+	if (!copied || dir_gen[i] != gen || dir_writes[i] != writes || txn_active || !aio_idle()) {
+		relocate_release(start, n);
+		pthread_rwlock_unlock(&dir_lock);
+		free(from);
+		free(to);
+		return 0;
+	}
+
+	for (k = 0; k < n; k = j) {
+		for (j = k + 1; j < n && from[j] == from[j - 1] + 1; j++);
+		cache_invalidate(from[k], j - k);
+	}
+
+	pthread_mutex_lock(&meta_lock);
+	dir[i].first_block = start;
+	dir_touch(i);
+	map_drop(i);
+	for (k = 0; k < n; k++)
+		fat_set(from[k], FAT_FREE);
+	pthread_mutex_unlock(&meta_lock);
+
+	for (j = 0; j < __atomic_load_n(&opened_slots, __ATOMIC_ACQUIRE); j++) {
+		f = opened_file_list[j];
+		if (f->id == -1 || f->index != i) continue;
+		for (k = 0; k < n; k++) {
+			if (from[k] == f->tail_block) f->tail_block = start + k;
+			if (from[k] == f->current_pos) f->current_pos = start + k;
+		}
+	}
+	update();
+	pthread_rwlock_unlock(&dir_lock);
+	free(from);
+	free(to);
+	return 1;
+}
+
+/* fs_defrag: Function responsible for moving each fragmented file to a contiguous run of free
+	clusters. Only the file being moved waits for its copy, so the pass runs alongside other calls;
+	with budget_ms > 0 it stops once that much time went by and the next call resumes where
+	it stopped. Returns how many files were moved (-1 if a batch is open) and leaves in
+	*pending how many are still fragmented. */
+	int fs_defrag(int budget_ms, int *pending) {
+		static int cursor = 0;
+		struct timespec start, now;
+		int i, k, clusters, moved = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (k = 0; ; k++) {
+			pthread_rwlock_wrlock(&dir_lock);
+			if (txn_active) {
+				pthread_rwlock_unlock(&dir_lock);
+				printf ("A batch is open.");
+				moved = -1;
+				break;
+			}
+			/* Writes in flight would land on the old clusters */
+			if (k >= dir_entries || !aio_idle()) {
+				pthread_rwlock_unlock(&dir_lock);
+				break;
+			}
+
+			i = cursor < dir_entries ? cursor : 0;
+			cursor = i + 1;
+			if (dir[i].used == 0 || file_extents(i, &clusters) == 1) clusters = 0;
+			pthread_rwlock_unlock(&dir_lock);
+
+			if (clusters > 0 && file_relocate(i, clusters)) moved++;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (budget_ms > 0 && (now.tv_sec - start.tv_sec)*1000 +
+					(now.tv_nsec - start.tv_nsec)/1000000 >= budget_ms) break;
+		}
+
+		if (pending != NULL) {
+			*pending = 0;
+			pthread_rwlock_rdlock(&dir_lock);
+			for (i = 0; i < dir_entries; i++) {
+				if (dir[i].used == 0) continue;
+				pthread_rwlock_rdlock(&file_locks[i % FILE_LOCKS]);
+				if (file_extents(i, &clusters) > 1) (*pending)++;
+				pthread_rwlock_unlock(&file_locks[i % FILE_LOCKS]);
+			}
+			pthread_rwlock_unlock(&dir_lock);
+		}
+		return moved;
+	}
+
+/* fs_open: Function responsible for opening a file. */
+	int fs_open(char *file_name, int mode) {
+		
+  		int i, first_block, first_entry;
+  		char file_exists = 0;
   
+		/* Opening for writing may create or truncate the file */
+		if (mode == FS_W) pthread_rwlock_wrlock(&dir_lock);
+		else pthread_rwlock_rdlock(&dir_lock);
+
+  		checkdisk();
+
+  		/* Find file */
+		if ((first_entry = dir_lookup(file_name)) != -1) {
+			first_block = dir[first_entry].first_block;
+			file_exists = 1;
+		}
+  		
 		if (file_exists == 1) {
-    		/* Find first entry of file */
-			for (i = 0; i < 128; i++) {
-				if (opened_file_list[i].id == -1) {
-					if (mode == FS_R) {
-						opened_file_list[i].mode = FS_R;
-					}
-        			
-        			/* If write mode, rewrite file with size 0 */
-					if (mode == FS_W) {
-						fs_remove (file_name);
-						strcpy (dir[first_entry].name, file_name);
-						
-						opened_file_list[i].index = first_entry;
-						dir[first_entry].size = 0;
-						dir[first_entry].used = 1;
-						dir[first_entry].first_block = first_block;
-						fat[first_block] = 2;
-          				
-          				update();
-
-          				opened_file_list[i].mode = FS_W;
-					}
-
-					/* Put file on opened file list */
-					opened_file_list[i].index = first_entry;
-					opened_file_list[i].counter = 0;
-					opened_file_list[i].total = 0;
-
-        			/* Attribute id to opened file */
-					opened_file_list[i].id = id;
-					opened_file_list[i].current_pos = 0;
-        			
-					return opened_file_list[i].id;
-				}
+			/* Truncating would pull the clusters from under the other handles */
+			if (mode == FS_W && dir_busy(first_entry)) {
+				pthread_rwlock_unlock(&dir_lock);
+				return -1;
+			}
+			if ((i = opened_alloc()) == -1) {
+				pthread_rwlock_unlock(&dir_lock);
+				printf("Too many opened files.");
+				return -1;
+			}
+			opened_file_list[i]->mode = FS_R;
+
+			/* If write mode, rewrite file with size 0 */
+			if (mode == FS_W) {
+				file_remove (file_name);
+				pthread_mutex_lock(&meta_lock);
+				strcpy (dir[first_entry].name, file_name);
+
+				dir[first_entry].size = 0;
+				dir[first_entry].used = 1;
+				dir[first_entry].first_block = first_block;
+				dir_touch(first_entry);
+				dir_index_add(first_entry);
+				if (first_entry == dir_hint) dir_hint++;
+				fat_set(first_block, FAT_EOF);
+				pthread_mutex_unlock(&meta_lock);
+
+				update();
+
+				opened_file_list[i]->mode = FS_W;
 			}
     	} else {
 			if (mode == FS_R) {
+				pthread_rwlock_unlock(&dir_lock);
 				printf("File doesn't exist");
 				return -1;
 			}
 			
     		/* If is in write mode, we have to re-write a new file */
-			for (i = 0; i < 128; i++) {
-				if (opened_file_list[i].id == -1) {
-					opened_file_list[i].id = id;
-					if (!fs_create(file_name)) {
-						return 0;
-					}
-        			
-        			/* Find first entry of the file in directory */
-					for (j = 0; j < 128; j++) {
-						if (!strcmp (dir[j].name, file_name)) {
-							first_entry = j;
-						}
-					}
-        			
-        			/* Put file in opened file list */
-					opened_file_list[i].index = first_entry;
-					opened_file_list[i].counter = 0;
-					opened_file_list[i].total = 0;
-					opened_file_list[i].mode = FS_W;
-					opened_file_list[i].current_pos = 0;
-
-					return opened_file_list[i].id;
-				}
+			if (!file_create(file_name, -1, 0)) {
+				pthread_rwlock_unlock(&dir_lock);
+				return -1;
 			}
+			if ((i = opened_alloc()) == -1) {
+				pthread_rwlock_unlock(&dir_lock);
+				printf("Too many opened files.");
+				return -1;
+			}
+			first_entry = dir_lookup(file_name);
+			first_block = dir[first_entry].first_block;
+			opened_file_list[i]->mode = FS_W;
 		}
-		return -1;
+
+		/* Put file on opened file list */
+		opened_file_list[i]->index = first_entry;
+		opened_file_list[i]->life = dir_life[first_entry];
+		opened_file_list[i]->counter = 0;
+		opened_file_list[i]->total = 0;
+		opened_file_list[i]->current_pos = 0;
+		opened_file_list[i]->tail_block = first_block;
+		opened_file_list[i]->tail_offset = 0;
+		opened_file_list[i]->map_len = 0;
+		opened_file_list[i]->map_gen = dir_gen[first_entry];
+		opened_file_list[i]->ra_last = -1;
+		opened_file_list[i]->ra_window = 0;
+		opened_file_list[i]->ra_end = 0;
+		__atomic_add_fetch(&dir_opened[first_entry], 1, __ATOMIC_RELAXED);
+
+		pthread_rwlock_unlock(&dir_lock);
+		return opened_file_list[i]->id;
 	}
 
 /* fs_close: Function to close file. */
 	int fs_close(int file)  {
-		int i;
+		int i = handle_take(file, 1);
 		
-		for (i = 0; i < 128; i++) {
-			if(opened_file_list[i].id == file){
-				opened_file_list[i].mode = -1;
-				opened_file_list[i].id = -1;
-				opened_file_list[i].index = -1;
-				opened_file_list[i].counter = 0;
-				opened_file_list[i].current_pos = 0;
-				opened_file_list[i].total = 0;
-				return 1;
-			}
+		if (i == -1) {
+			printf("There is no file with this identifier...");
+			return 0;
 		}
 
-		printf("There is no file with this identifier...");
-		return 0;
+		/* A stale handle no longer counts on the entry, which may hold another file now */
+		pthread_rwlock_unlock(&file_locks[opened_file_list[i]->index % FILE_LOCKS]);
+		if (opened_file_list[i]->life == dir_life[opened_file_list[i]->index])
+			__atomic_sub_fetch(&dir_opened[opened_file_list[i]->index], 1, __ATOMIC_RELAXED);
+		opened_file_list[i]->mode = -1;
+		opened_file_list[i]->id = -1;
+		opened_file_list[i]->index = -1;
+		opened_file_list[i]->counter = 0;
+		opened_file_list[i]->current_pos = 0;
+		opened_file_list[i]->total = 0;
+		free(opened_file_list[i]->map);
+		opened_file_list[i]->map = NULL;
+		opened_file_list[i]->map_len = opened_file_list[i]->map_cap = 0;
+		pthread_mutex_unlock(&opened_file_list[i]->lock);
+		pthread_rwlock_unlock(&dir_lock);
+
+		/* Slot goes back to the free list */
+		pthread_mutex_lock(&table_lock);
+		opened_file_list[i]->next_free = free_slot;
+		free_slot = i;
+		pthread_mutex_unlock(&table_lock);
+		return 1;
 	}
 
-/* fs_write: Function to write file into FAT */
-	int fs_write(char *buffer, int size, int file) {
-		int a, b, i, index, aux_size, id = -1;
-  		
-  		char* aux_file = malloc(CLUSTERSIZE*sizeof(char));
+/* file_append: Appends size bytes from buffer to opened file id, starting at its tail cursor.
+	Whole clusters are queued on aio when it isn't -1. Returns how many bytes made it to the file. */
+static int file_append(int id, char *buffer, int size, int aio) {
+	int index = opened_file_list[id]->index;
+	char *aux_file;
+	int writeblock, last_block, done, count, start, next, pending;
+
+	/* Append cursor: no need to walk the FAT chain to find the last block */
+	writeblock = opened_file_list[id]->tail_block;
+	last_block = opened_file_list[id]->tail_offset;
+
+	if ((aux_file = buf_get()) == NULL) return 0;
+
+	for (done = 0; done < size; ) {
+		/* A full last block only gets a successor once there is data for it */
+		if (last_block == cluster_size) {
+			if ((next = append_block(writeblock)) == -1) break;
+			writeblock = next;
+			last_block = 0;
+		}
 
-  		int aux, writeblock, next_block, last_block;
-  		
-  		/* Find file */
-		for (i = 0; i < 128; i++) {
-			if (opened_file_list[i].id == file) {
-				id = i;
-				index = opened_file_list[i].index;
+		if (last_block == 0 && size - done >= cluster_size) {
+			/* Whole clusters go straight from the caller's buffer to the disk,
+				a run of contiguous clusters at a time */
+			start = writeblock;
+			pending = -1;
+			for (count = 1; count < (size - done) / cluster_size; count++) {
+				if ((next = append_block(writeblock)) == -1) break;
+				if (next != writeblock + 1) {
+					pending = next;
+					break;
+				}
+				writeblock = next;
 			}
-    		
-    		if (opened_file_list[i].id == file && opened_file_list[i].mode == FS_R) {
-				printf("File is currently in read mode.");
-				return 0;
+
+			if (!write_run(&buffer[done], start, count, aio)) break;
+			done += count * cluster_size;
+			last_block = cluster_size;
+
+			/* First cluster of the next run, already linked to the chain */
+			if (pending != -1) {
+				writeblock = pending;
+				last_block = 0;
 			}
+		} else {
+			/* Partial cluster: new data goes after what the block already has */
+			count = cluster_size - last_block;
+			if (count > size - done) count = size - done;
+
+			if (!write_part (&buffer[done], writeblock, last_block, count, last_block == 0, aux_file)) break;
+
+			done += count;
+			last_block += count;
+		}
+	}
+	buf_put(aux_file);
+
+	/* Update what was written up to now */
+	opened_file_list[id]->tail_block = writeblock;
+	opened_file_list[id]->tail_offset = last_block;
+	opened_file_list[id]->counter += done;
+	pthread_mutex_lock(&meta_lock);
+	dir[index].size = opened_file_list[id]->counter;
+	dir_touch(index);
+	pthread_mutex_unlock(&meta_lock);
+
+	return done;
+}
+
+/* file_overwrite: Replaces size bytes of opened file id at offset, all inside the file.
+	Whole clusters are queued on aio when it isn't -1. Returns how many bytes were written. */
+static int file_overwrite(int id, char *buffer, int size, int offset, int aio) {
+	char *aux_file;
+	int done, count, block, n, pos;
+
+	if ((aux_file = buf_get()) == NULL) return 0;
+
+	for (done = 0; done < size; ) {
+		n = (offset + done) / cluster_size;
+		pos = (offset + done) % cluster_size;
+		if ((block = map_block(id, n)) == -1) break;
+
+		if (pos == 0 && size - done >= cluster_size) {
+			for (count = 1; count < (size - done) / cluster_size && map_block(id, n + count) == block + count; count++);
+			if (!write_run(&buffer[done], block, count, aio)) break;
+			done += count * cluster_size;
+		} else {
+			count = cluster_size - pos;
+			if (count > size - done) count = size - done;
+
+			if (!write_part (&buffer[done], block, pos, count, 0, aux_file)) break;
+			done += count;
 		}
+	}
+	buf_put(aux_file);
+
+	return done;
+}
+
+/* fs_write: Function to write file into FAT */
+	int fs_write(char *buffer, int size, int file) {
+		int id = handle_lock(file), done;
 
   		if (id == -1) {
 			printf ("File isn't opened or doesn't exist.");
 			return -1;
 		}
+		if (opened_file_list[id]->mode == FS_R) {
+			handle_unlock(id);
+			printf("File is currently in read mode.");
+			return 0;
+		}
 
-  		next_block = dir[index].first_block;
-  		while (next_block != 2) {
-			aux = fat[next_block];
-			if (aux == 2) {
-				writeblock = next_block;
-			}
-			next_block = aux;
+		done = file_append(id, buffer, size, -1);
+
+		update();
+		handle_unlock(id);
+		return (done == 0 && size > 0) ? -1 : done;
+	}
+
+/* file_pwrite: Writes size bytes at offset of handle file, see fs_pwrite. Whole clusters
+	are queued on aio when it isn't -1. */
+static int file_pwrite(char *buffer, int size, int file, int offset, int aio) {
+		int id = handle_lock(file), inside, done;
+
+		if (id == -1) {
+			printf ("File isn't opened or doesn't exist.");
+			return -1;
+		}
+		if (opened_file_list[id]->mode == FS_R) {
+			handle_unlock(id);
+			printf("File is currently in read mode.");
+			return 0;
+		}
+		if (offset < 0 || offset > opened_file_list[id]->counter) {
+			handle_unlock(id);
+			printf ("Offset is past the end of the file.");
+			return -1;
 		}
-  		
-  		aux_size = dir[index].size;
-		aux = 0;
-  		
-  		last_block = (aux_size % CLUSTERSIZE);
-  		
-  		if ((last_block + size) > CLUSTERSIZE) {
-			/* Divide process in two parts, write first_block b, and then a which is the exceeding rest. */
-			a = (last_block + size) - CLUSTERSIZE;
-			b = size - a;
-
-			if (!read_block (aux_file, writeblock)) return -1;
-    		
-    		/* Adding new content to the end of aux_file */
-			for (i = last_block; i < last_block+b; i++) {
-				aux_file[i] = buffer[aux];
-				aux++;
-			}
 
-			if (!write_block (aux_file, writeblock)) return -1;
-    		
-    		/* Find next free block in FAT */
-			for (i = 33; i < (bl_size()/8); i++) {
-				if (fat[i] == 1) {
-					fat[writeblock] = i;
-					writeblock = i;
-					fat[i] = 2;
-					break;
-				}
-			}
-    		
-    		/* Clean buffer and put rest of data in it */
-			strcpy (aux_file, "");
-			for (i = 0; i < a; i++) {
-				aux_file[i] = buffer[aux];
-				aux++;
-			}
-    		
-    		if(!write_block (aux_file, writeblock)) return -1;
-    		
-    		/* Update what was written up to now */
-			opened_file_list[id].counter += size;
-    		dir[index].size = opened_file_list[id].counter;
-		} else {
-			/* In case of not exceeding the size of the last block, move disk content to buffer, 
-			add the new content to block and update directory. */
-			if (!read_block (aux_file, writeblock)) return -1;  
+		inside = opened_file_list[id]->counter - offset;
+		if (inside > size) inside = size;
 
-			for (i = last_block; i < last_block+size; i++) {
-				aux_file[i] = buffer[aux];
-				aux++;
-			}
+		done = file_overwrite(id, buffer, inside, offset, aio);
+		if (done == inside && size > inside)
+			done += file_append(id, &buffer[inside], size - inside, aio);
+
+		update();
+		handle_unlock(id);
+		return (done == 0 && size > 0) ? -1 : done;
+}
+
+/* fs_pwrite: Function to write a file at offset, which may not be past its end.
+	Bytes inside the file are replaced, the rest is appended. */
+	int fs_pwrite(char *buffer, int size, int file, int offset) {
+		return file_pwrite(buffer, size, file, offset, -1);
+	}
+
+/* fs_fallocate: Function responsible for reserving clusters for the next bytes written to a file.
+	Clusters come in contiguous extents, extending the chain in place when possible. */
+	int fs_fallocate(int file, int bytes) {
+		int i, id = handle_lock(file), index, last, have, need, start, len;
+
+		if (id == -1 || opened_file_list[id]->mode != FS_W) {
+			if (id != -1) handle_unlock(id);
+			printf ("File isn't opened in write mode.");
+			return 0;
+		}
+		index = opened_file_list[id]->index;
+
+		/* Clusters already in the chain: up to the tail, plus reserved ones */
+		have = 1 + (opened_file_list[id]->counter - opened_file_list[id]->tail_offset) / cluster_size;
+		for (last = opened_file_list[id]->tail_block; fat[last] != FAT_EOF; last = fat[last])
+			have++;
+		need = (opened_file_list[id]->counter + bytes + cluster_size - 1) / cluster_size;
+
+		pthread_mutex_lock(&meta_lock);
+		if (need - have > free_settle(need - have)) {
+			pthread_mutex_unlock(&meta_lock);
+			handle_unlock(id);
+			printf ("Disk is full!\n");
+			return 0;
+		}
+
+		/* An empty file gives up its first cluster so the whole file fits in one extent */
+		if (have == 1 && need > 1 && opened_file_list[id]->counter == 0 &&
+				free_scan(last + 1, 0) - (last + 1) < need - 1) {
+			chain_free(last);
+			start = free_extent(need, &len);
+			for (i = start; i < start + len - 1; i++)
+				fat_set(i, i + 1);
+			fat_set(start + len - 1, FAT_EOF);
+			dir[index].first_block = start;
+			dir_touch(index);
+			map_drop(index);
+			opened_file_list[id]->tail_block = start;
+			have = len;
+			last = start + len - 1;
+		}
 
-			if (!write_block (aux_file, writeblock)) return -1;
-			opened_file_list[id].counter += size;
-			dir[index].size = opened_file_list[id].counter;
+		while (have < need) {
+			/* Grow in place if the clusters after the chain are free */
+			if (last + 1 < free_limit && (free_map[(last + 1)/64] & (1UL << ((last + 1)%64)))) {
+				start = last + 1;
+				len = free_scan(start, 0) - start;
+				if (len > need - have) len = need - have;
+			} else {
+				start = free_extent(need - have, &len);
+			}
+			fat_set(last, start);
+			for (i = start; i < start + len - 1; i++)
+				fat_set(i, i + 1);
+			fat_set(start + len - 1, FAT_EOF);
+			have += len;
+			last = start + len - 1;
 		}
+		pthread_mutex_unlock(&meta_lock);
 
 		update();
-		free(aux_file);
-		return size;
+		handle_unlock(id);
+		return 1;
 	}
 
+/* readahead: Called by fs_read before using the n-th cluster of opened file id, found at block.
+	Reading the cluster after the last one keeps the stream sequential: once half of the
+	window is consumed the next clusters of the chain are prefetched into the cache and
+	the window doubles. Any other cluster collapses the window. */
+static void readahead(int id, int n, int block) {
+	opened_file *f = opened_file_list[id];
+	int blocks[RA_MAX], i, first, last, count;
+
+	/* An image in memory needs no cache, the host reads its mapping ahead */
+	if (bl_ptr(0) != NULL) return;
+	if (n == f->ra_last) return;
+	if (n != f->ra_last + 1) {
+		f->ra_last = n;
+		f->ra_window = 0;
+		f->ra_end = n + 1;
+		return;
+	}
+	f->ra_last = n;
+	if (f->ra_window == 0) {
+		f->ra_window = RA_MIN;
+		f->ra_end = n + 1;
+	}
+	if (n + f->ra_window/2 < f->ra_end) return;
+
+	/* Prefetch up to the end of the window and of the file, and leave
+		most of the cache to everyone else */
+	first = f->ra_end > n + 1 ? f->ra_end : n + 1;
+	last = n + f->ra_window;
+	if (last > (dir[f->index].size - 1) / cluster_size)
+		last = (dir[f->index].size - 1) / cluster_size;
+	if (last - first + 1 > cache_size/2)
+		last = first + cache_size/2 - 1;
+
+	for (i = n; i < first && fat[block] != FAT_EOF; i++)
+		block = fat[block];
+	count = 0;
+	while (i == first && first + count <= last) {
+		blocks[count++] = block;
+		if (fat[block] == FAT_EOF) break;
+		block = fat[block];
+	}
+	if (count > 0) cache_prefetch(blocks, count);
+
+	f->ra_end = first + count;
+	if (f->ra_window < RA_MAX) f->ra_window *= 2;
+}
+
 /* fs_read: Function responsible for reading a file. */
 	int fs_read(char *buffer, int size, int file) {
-  		int i, id = -1, index;
-		int a, b;
-		int aux = 0;
-		int next;
+  		int id = handle_lock(file), index;
+		int done, count, block, n;
+		char *aux_file;
+		opened_file *f;
 
-		char *aux_file = malloc (CLUSTERSIZE*sizeof(char));
-		
-		for (i = 0; i < 128; i++) {
-		  	if (opened_file_list[i].id == file) {
-		  		id = i;
-		  		index = opened_file_list[i].index;
-		  	}
-		  	if (opened_file_list[i].id == file && opened_file_list[i].mode == FS_W) {
-		  		printf("File is in write mode.");
-		  		return -1;
-		  	}
+		if (id == -1) {
+			printf ("File isn't opened or doesn't exist.");
+			return -1;
+		}
+		if (opened_file_list[id]->mode == FS_W) {
+			handle_unlock(id);
+			printf("File is in write mode.");
+			return -1;
 		}
+		index = opened_file_list[id]->index;
+		f = opened_file_list[id];
 
 		/* If current_pos is 0, then reading hasn't started yet */		  
-		if (opened_file_list[id].current_pos == 0) {
-		  	opened_file_list[id].current_pos = dir[index].first_block;
-		}
-		  
-		/*If reading a file occupying more than one block, then do: */
-		if ((opened_file_list[id].counter + size) > CLUSTERSIZE) {
-		    /* Same process done in the fs_write. */
-		  	a = (opened_file_list[id].counter + size) - CLUSTERSIZE;
-		  	b = size - a;
-		    
-
-		    if ((b + opened_file_list[id].total) >= dir[index].size) {
-		    	b = dir[index].size - opened_file_list[id].total;
-		    	a = 0;
-		    	size = b;
-		    }else if ((a + b + opened_file_list[id].total) >= dir[index].size) {
-		    	a = dir[index].size - opened_file_list[id].total;
-		    	size = b + a;
-		    }
-
-		    /*If size is 0, then read process is over.*/
-		    if (size == 0) {
-		    	return 0;
-		    }
-
-		    if(!read_block(aux_file, opened_file_list[id].current_pos))
-		    	return -1;
-		    
-		    /*Write in read buffer what has been already read*/
-		    for (i = opened_file_list[id].counter; i < opened_file_list[id].counter+b; i++) {
-		    	buffer[aux] = aux_file[i];
-		    	aux++;
-		    }
-
-		    next = opened_file_list[id].current_pos;
-		    opened_file_list[id].current_pos = fat[next];
-		    
-		    if(!read_block(aux_file, opened_file_list[id].current_pos))
-		    	return -1;
-		    
-		    opened_file_list[id].counter = 0;
-
-		    for(i = opened_file_list[id].counter; i < opened_file_list[id].counter + a; i++) {
-		    	buffer[aux] = aux_file[i];
-		    	aux++;
-		    }
-		    /*counter receives what has been read in the beginning of the next block */
-		    opened_file_list[id].counter += a;
-		    /*total receives the total amount of read data*/
-		    opened_file_list[id].total += a + b;
-		}else{
-		    if ((opened_file_list[id].total + size) >= dir[index].size) {
-				size = dir[index].size - opened_file_list[id].total;
+		if (opened_file_list[id]->current_pos == 0) {
+		  	opened_file_list[id]->current_pos = dir[index].first_block;
+		}
+
+		/* Never read past the end of the file */
+		if (size > dir[index].size - opened_file_list[id]->total) {
+			size = dir[index].size - opened_file_list[id]->total;
+		}
+
+		if ((aux_file = buf_get()) == NULL) {
+			handle_unlock(id);
+			return -1;
+		}
+
+		for (done = 0; done < size; ) {
+			/* counter reached the end of current block, move to the next one */
+			if (opened_file_list[id]->counter == cluster_size) {
+				opened_file_list[id]->current_pos = fat[opened_file_list[id]->current_pos];
+				opened_file_list[id]->counter = 0;
 			}
-		    
-		    if (size == 0) {
-				return 0;
-			} 
-		    
-		    if (!read_block (aux_file, opened_file_list[id].current_pos))
-				return -1;
-		    
-		    for (i = opened_file_list[id].counter; i < opened_file_list[id].counter+size; i++) {
-				buffer[aux] = aux_file[i];
-				aux++;
+			block = opened_file_list[id]->current_pos;
+			n = (opened_file_list[id]->total + done) / cluster_size;
+
+			/* Whole clusters go straight from the disk to the caller's buffer,
+				a run of contiguous clusters at a time, unless the read is
+				smaller than the read-ahead window already filling the cache */
+			if (opened_file_list[id]->counter == 0 && size - done >= cluster_size &&
+					(size - done) / cluster_size >= f->ra_window) {
+				for (count = 1; count < (size - done) / cluster_size && fat[block] == block + 1; count++)
+					block++;
+
+				if (!read_run(&buffer[done], opened_file_list[id]->current_pos, count, -1)) break;
+				done += count * cluster_size;
+				opened_file_list[id]->current_pos = block;
+				opened_file_list[id]->counter = cluster_size;
+				/* A sequential stream of whole clusters grows the window as well,
+					until reads this size are served by read-ahead */
+				if (n != f->ra_last + 1) f->ra_window = 0;
+				else if (f->ra_window == 0) f->ra_window = RA_MIN;
+				else if (f->ra_window < RA_MAX) f->ra_window *= 2;
+				f->ra_last = n + count - 1;
+				if (f->ra_end < n + count) f->ra_end = n + count;
+			} else {
+				readahead(id, n, block);
+				count = cluster_size - opened_file_list[id]->counter;
+				if (count > size - done) count = size - done;
+
+				if (!read_part (&buffer[done], block, opened_file_list[id]->counter, count, aux_file)) break;
+				done += count;
+				opened_file_list[id]->counter += count;
 			}
+		}
+		buf_put(aux_file);
+
+		/*total receives the total amount of read data*/
+		opened_file_list[id]->total += done;
+
+		handle_unlock(id);
+		return (done == 0 && size > 0) ? -1 : done;
+	}
+
+
+/* file_pread: Reads size bytes at offset of handle file, see fs_pread. Whole clusters
+	are queued on aio when it isn't -1. */
+static int file_pread(char *buffer, int size, int file, int offset, int aio) {
+		int id = handle_lock(file), index;
+		int done, count, block, n, pos;
+		char *aux_file;
 
-			opened_file_list[id].counter += size;
-			opened_file_list[id].total += size;
+		if (id == -1) {
+			printf ("File isn't opened or doesn't exist.");
+			return -1;
+		}
+		if (opened_file_list[id]->mode == FS_W) {
+			handle_unlock(id);
+			printf("File is in write mode.");
+			return -1;
+		}
+		index = opened_file_list[id]->index;
+		if (offset < 0 || offset > dir[index].size) {
+			handle_unlock(id);
+			printf ("Offset is past the end of the file.");
+			return -1;
 		}
-		
-		free(aux_file);
 
-		return size;
+		if (size > dir[index].size - offset) {
+			size = dir[index].size - offset;
+		}
+
+		if ((aux_file = buf_get()) == NULL) {
+			handle_unlock(id);
+			return -1;
+		}
+
+		for (done = 0; done < size; ) {
+			n = (offset + done) / cluster_size;
+			pos = (offset + done) % cluster_size;
+			if ((block = map_block(id, n)) == -1) break;
+
+			if (pos == 0 && size - done >= cluster_size) {
+				for (count = 1; count < (size - done) / cluster_size && map_block(id, n + count) == block + count; count++);
+				if (!read_run(&buffer[done], block, count, aio)) break;
+				done += count * cluster_size;
+			} else {
+				count = cluster_size - pos;
+				if (count > size - done) count = size - done;
+
+				if (!read_part (&buffer[done], block, pos, count, aux_file)) break;
+				done += count;
+			}
+		}
+		buf_put(aux_file);
+
+		handle_unlock(id);
+		return (done == 0 && size > 0) ? -1 : done;
+}
+
+/* fs_pread: Function responsible for reading a file from offset, without moving its read position.
+	Clusters are found through the handle's cluster map instead of following the FAT. */
+	int fs_pread(char *buffer, int size, int file, int offset) {
+		return file_pread(buffer, size, file, offset, -1);
+	}
+
+/* aio_alloc: Takes a free asynchronous request, starting the disk queue on first use.
+	Returns it or -1. */
+static int aio_alloc() {
+	int i, aio = -1;
+
+	pthread_mutex_lock(&aio_lock);
+	if (aio_queue == NULL) aio_queue = bl_queue_create();
+	for (i = 0; i < AIO_SLOTS && aio_queue != NULL; i++) {
+		if (!aio_list[(aio_hint + i) % AIO_SLOTS].busy) {
+			aio = (aio_hint + i) % AIO_SLOTS;
+			aio_hint = aio + 1;
+			aio_list[aio].busy = 1;
+			aio_list[aio].failed = 0;
+			aio_list[aio].bytes = 0;
+			aio_list[aio].pending = 0;
+			aio_list[aio].batch_len = 0;
+			break;
+		}
 	}
+	pthread_mutex_unlock(&aio_lock);
+	return aio;
+}
+
+/* aio_release: Gives back a request that was never submitted. */
+static void aio_release(int aio) {
+	pthread_mutex_lock(&aio_lock);
+	aio_list[aio].busy = 0;
+	pthread_mutex_unlock(&aio_lock);
+}
+
+/* aio_queue_run: Adds a run of count blocks from/to buffer to the batch of request aio. */
+static int aio_queue_run(int aio, int op, char *buffer, int block, int count) {
+	fs_aio *a = &aio_list[aio];
+	bl_request **batch;
+	aio_run *run;
+
+	if (a->batch_len == a->batch_cap) {
+		if ((batch = realloc (a->batch, (a->batch_cap ? 2*a->batch_cap : 16)*sizeof(bl_request *))) == NULL)
+			return 0;
+		a->batch = batch;
+		a->batch_cap = a->batch_cap ? 2*a->batch_cap : 16;
+	}
+	if ((run = malloc (sizeof(aio_run))) == NULL) return 0;
+
+	run->iov.iov_base = buffer;
+	run->iov.iov_len = (size_t) count*cluster_size;
+	run->aio = aio;
+	run->req.op = op;
+	run->req.sector = block*cluster_sectors;
+	run->req.iov = &run->iov;
+	run->req.iovcnt = 1;
+	run->req.data = run;
+	a->batch[a->batch_len++] = &run->req;
+	return 1;
+}
+
+/* aio_submit: Hands the batch of request aio to the disk queue, its runs are
+	in flight from now on. Returns the request. */
+static int aio_submit(int aio, int bytes) {
+	fs_aio *a = &aio_list[aio];
+	int i;
+
+	pthread_mutex_lock(&aio_lock);
+	a->bytes = bytes;
+	a->pending = a->batch_len;
+	pthread_mutex_unlock(&aio_lock);
+
+	if (a->batch_len > 0 && bl_submit(aio_queue, a->batch, a->batch_len) != a->batch_len) {
+		for (i = 0; i < a->batch_len; i++)
+			free (a->batch[i]->data);
+		pthread_mutex_lock(&aio_lock);
+		a->pending = 0;
+		a->failed = 1;
+		pthread_mutex_unlock(&aio_lock);
+	}
+	a->batch_len = 0;
+	return aio;
+}
+
+/* aio_reap: Completes a run taken from the disk queue. A written run drops the
+	clean cached copies of its blocks, they may have been read from the disk
+	while it was in flight. */
+static void aio_reap(bl_request *req) {
+	aio_run *run = req->data;
+	int i, s, block = req->sector/cluster_sectors;
+
+	if (req->op == BL_WRITE) {
+		pthread_mutex_lock(&cache_lock);
+		for (i = block; i < block + (int) (run->iov.iov_len/cluster_size); i++) {
+			if ((s = cache_find(i)) != -1 && !cache[s].dirty)
+				cache_unhash(s);
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	pthread_mutex_lock(&aio_lock);
+	if (!req->result) aio_list[run->aio].failed = 1;
+	aio_list[run->aio].pending--;
+	pthread_mutex_unlock(&aio_lock);
+	free(run);
+}
 
+/* fs_read_async: Function responsible for starting a read of a file from offset, like fs_pread.
+	Whole clusters are read in the background into buffer, which must be left alone
+	until fs_aio_wait returns. Returns the request to wait for, or -1. */
+	int fs_read_async(char *buffer, int size, int file, int offset) {
+		int aio = aio_alloc(), done;
+
+		if (aio == -1) {
+			printf ("Too many asynchronous requests.");
+			return -1;
+		}
+		/* Nothing was queued when the read failed */
+		done = file_pread(buffer, size, file, offset, aio);
+		if (done == -1) {
+			aio_release(aio);
+			return -1;
+		}
+		return aio_submit(aio, done);
+	}
+
+/* fs_write_async: Function responsible for starting a write of a file at offset, like fs_pwrite.
+	The clusters are allocated at once and whole ones are written in the background
+	from buffer, which must be left alone until fs_aio_wait returns. Returns the
+	request to wait for, or -1. */
+	int fs_write_async(char *buffer, int size, int file, int offset) {
+		int aio = aio_alloc(), done;
+
+		if (aio == -1) {
+			printf ("Too many asynchronous requests.");
+			return -1;
+		}
+		done = file_pwrite(buffer, size, file, offset, aio);
+		if (done == -1 || (done == 0 && size > 0)) {
+			aio_release(aio);
+			return -1;
+		}
+		return aio_submit(aio, done);
+	}
+
+/* fs_aio_wait: Function responsible for waiting for an asynchronous request to finish.
+	One waiter at a time reaps the disk queue on behalf of everyone.
+	Returns how many bytes it moved, or -1 on failure. */
+	int fs_aio_wait(int request) {
+		bl_request *done[64];
+		int i, n, result;
+
+		pthread_mutex_lock(&aio_lock);
+		if (request < 0 || request >= AIO_SLOTS || !aio_list[request].busy) {
+			pthread_mutex_unlock(&aio_lock);
+			printf ("No such asynchronous request.");
+			return -1;
+		}
+		while (aio_list[request].pending > 0) {
+			if (aio_reaping) {
+				pthread_cond_wait(&aio_done, &aio_lock);
+				continue;
+			}
+			aio_reaping = 1;
+			pthread_mutex_unlock(&aio_lock);
+
+			n = bl_complete(aio_queue, done, 1, 64);
+			for (i = 0; i < n; i++)
+				aio_reap(done[i]);
+
+			pthread_mutex_lock(&aio_lock);
+			aio_reaping = 0;
+			pthread_cond_broadcast(&aio_done);
+		}
+		result = aio_list[request].failed ? -1 : aio_list[request].bytes;
+		aio_list[request].busy = 0;
+		pthread_mutex_unlock(&aio_lock);
+		return result;
+	}
+
+/* fs_seek: Function responsible for moving the read position of a file to offset. */
+	int fs_seek(int file, int offset) {
+		int id = handle_lock(file), index, n;
+
+		if (id == -1) {
+			printf ("File isn't opened or doesn't exist.");
+			return -1;
+		}
+		if (opened_file_list[id]->mode == FS_W) {
+			handle_unlock(id);
+			printf("File is in write mode, use fs_pwrite.");
+			return -1;
+		}
+		index = opened_file_list[id]->index;
+		if (offset < 0 || offset > dir[index].size) {
+			handle_unlock(id);
+			printf ("Offset is past the end of the file.");
+			return -1;
+		}
+
+		/* A position at a cluster boundary stays at the end of the previous cluster,
+			the same state fs_read leaves behind */
+		n = offset / cluster_size;
+		opened_file_list[id]->counter = offset % cluster_size;
+		if (opened_file_list[id]->counter == 0 && n > 0) {
+			n--;
+			opened_file_list[id]->counter = cluster_size;
+		}
+		opened_file_list[id]->current_pos = map_block(id, n);
+		opened_file_list[id]->total = offset;
+
+		handle_unlock(id);
+		return offset;
+	}
 
 /* Auxiliary function */
 
-/*write_block: Function responsible to write things in the virtual disk image.*/
-int write_block(char *sectorBuffer, int sector){
+/* cache_find: Returns the cache slot holding block, or -1. */
+static int cache_find(int block) {
 	int s;
-	for (s = 0; s < 8; s++) {
-		/* write sectors 8 by 8, meaning only one block per time */
-		if (!bl_write ((sector*8)+s, &sectorBuffer[s*SECTORSIZE])) return 0;
+
+	for (s = cache_hash[block & (cache_buckets-1)]; s != -1; s = cache[s].hash_next)
+		if (cache[s].block == block) return s;
+	return -1;
+}
+
+/* cache_unhash: Removes slot s from its hash chain. */
+static void cache_unhash(int s) {
+	int *p;
+
+	if (cache[s].block == -1) return;
+	p = &cache_hash[cache[s].block & (cache_buckets-1)];
+	while (*p != s) p = &cache[*p].hash_next;
+	*p = cache[s].hash_next;
+	cache[s].block = -1;
+}
+
+/* cache_touch: Moves slot s to the head of the LRU list. */
+static void cache_touch(int s) {
+	if (lru_head == s) return;
+	cache[cache[s].prev].next = cache[s].next;
+	if (cache[s].next != -1) cache[cache[s].next].prev = cache[s].prev;
+	else lru_tail = cache[s].prev;
+	cache[s].prev = -1;
+	cache[s].next = lru_head;
+	cache[lru_head].prev = s;
+	lru_head = s;
+}
+
+/* cache_flush_slot: Writes slot s back to disk if it is dirty. */
+static int cache_flush_slot(int s) {
+	struct iovec iov = { cache[s].data, cluster_size };
+
+	if (!cache[s].dirty) return 1;
+	if (!bl_writev (cache[s].block*cluster_sectors, &iov, 1)) return 0;
+	cache[s].dirty = 0;
+	return 1;
+}
+
+/* cache_get: Returns a slot assigned to block, evicting the least recently
+	used cluster if needed. The slot content is only valid if the block was
+	already cached (*hit set to 1). */
+static int cache_get(int block, int *hit) {
+	int s = cache_find(block);
+
+	*hit = (s != -1);
+	if (s == -1) {
+		s = lru_tail;
+		if (!cache_flush_slot(s)) return -1;
+		cache_unhash(s);
+		cache[s].block = block;
+		cache[s].prefetched = 0;
+		cache[s].hash_next = cache_hash[block & (cache_buckets-1)];
+		cache_hash[block & (cache_buckets-1)] = s;
+	}
+	cache_touch(s);
+	return s;
+}
+
+/* cache_prefetch: Reads the given blocks into the cache, one vectored read per
+	run of contiguous blocks that aren't cached yet. */
+static void cache_prefetch(int *blocks, int count) {
+	struct iovec iov[RA_MAX];
+	int slots[RA_MAX], i, j, k, hit;
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < count; i = j) {
+		if (cache_find(blocks[i]) != -1) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < count && blocks[j] == blocks[i] + (j - i) && cache_find(blocks[j]) == -1; j++) {
+			if ((slots[j] = cache_get(blocks[j], &hit)) == -1) break;
+			iov[j - i].iov_base = cache[slots[j]].data;
+			iov[j - i].iov_len = cluster_size;
+		}
+		if (j == i) break;
+
+		if (!bl_readv (blocks[i]*cluster_sectors, iov, j - i)) {
+			for (k = i; k < j; k++)
+				cache_unhash(slots[k]);
+			break;
+		}
+		for (k = i; k < j; k++)
+			cache[slots[k]].prefetched = 1;
+		ra_clusters += j - i;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* cache_drop: Discards every cached cluster without writing it back. */
+static void cache_drop() {
+	int i;
+
+	for (i = 0; i < cache_buckets; i++)
+		cache_hash[i] = -1;
+	for (i = 0; i < cache_size; i++) {
+		cache[i].block = -1;
+		cache[i].dirty = 0;
+		cache[i].prefetched = 0;
+		cache[i].hash_next = -1;
+		cache[i].prev = i-1;
+		cache[i].next = (i == cache_size-1) ? -1 : i+1;
 	}
+	lru_head = 0;
+	lru_tail = cache_size-1;
+}
+
+/* buf_alloc: Allocates bytes aligned to BL_ALIGN, released with free. */
+static char *buf_alloc(size_t bytes) {
+	void *buffer;
+
+	return posix_memalign (&buffer, BL_ALIGN, bytes) == 0 ? buffer : NULL;
+}
+
+/* buf_get: Takes a cluster buffer from the pool, allocating one when it is empty. */
+static char *buf_get() {
+	char *buffer = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count > 0) buffer = pool[--pool_count];
+	pthread_mutex_unlock(&pool_lock);
+	return buffer != NULL ? buffer : buf_alloc(cluster_size);
+}
+
+/* buf_put: Gives a buffer from buf_get back to the pool, or frees it once the pool is full. */
+static void buf_put(char *buffer) {
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count < POOL_MAX) {
+		pool[pool_count++] = buffer;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(buffer);
+}
+
+/* pool_drain: Frees the pooled buffers, about to change size with the clusters. */
+static void pool_drain() {
+	pthread_mutex_lock(&pool_lock);
+	while (pool_count > 0)
+		free(pool[--pool_count]);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* cache_replace: Replaces the buffer cache by one of the given number of clusters of the
+	current size, writing back the old one. The directory must be write-locked,
+	so no I/O is going on. */
+static int cache_replace(int clusters) {
+	int i;
+	cache_slot *slots;
+	int *hash;
+
+	slots = malloc (clusters*sizeof(cache_slot));
+	for (i = 1; i < clusters; i <<= 1);
+	hash = malloc (i*sizeof(int));
+	if (slots == NULL || hash == NULL) {
+		free(slots);
+		free(hash);
+		return 0;
+	}
+	for (i = 0; i < clusters; i++) {
+		slots[i].data = buf_alloc(cluster_size);
+		if (slots[i].data == NULL) {
+			while (i-- > 0) free(slots[i].data);
+			free(slots);
+			free(hash);
+			return 0;
+		}
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < cache_size; i++) {
+		if (!cache_flush_slot(i)) {
+			pthread_mutex_unlock(&cache_lock);
+			for (i = 0; i < clusters; i++) free(slots[i].data);
+			free(slots);
+			free(hash);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < cache_size; i++)
+		free(cache[i].data);
+	free(cache);
+	free(cache_hash);
+
+	cache = slots;
+	cache_hash = hash;
+	cache_size = clusters;
+	cache_cluster = cluster_size;
+	for (cache_buckets = 1; cache_buckets < clusters; cache_buckets <<= 1);
+	cache_drop();
+	pthread_mutex_unlock(&cache_lock);
 	return 1;
 }
 
+/* fs_cache: Function responsible for (re)sizing the buffer cache to the given number of clusters. */
+	int fs_cache(int clusters) {
+		int resized;
+
+		if (clusters < 1) {
+			printf ("The cache needs at least one cluster.\n");
+			return 0;
+		}
+
+		/* No I/O may be going on while the slots are replaced */
+		pthread_rwlock_wrlock(&dir_lock);
+		resized = cache_replace(clusters);
+		pthread_rwlock_unlock(&dir_lock);
+		return resized;
+	}
+
+/* fs_cache_stats: Reports the cache hit and miss counters. */
+	void fs_cache_stats(long *hits, long *misses) {
+		pthread_mutex_lock(&cache_lock);
+		*hits = cache_hits;
+		*misses = cache_misses;
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+/* fs_readahead_stats: Reports how many clusters were read ahead and how many of them were used. */
+	void fs_readahead_stats(long *prefetched, long *hits) {
+		pthread_mutex_lock(&cache_lock);
+		*prefetched = ra_clusters;
+		*hits = ra_hits;
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+/* fs_sync: Function responsible for writing every dirty cluster and the metadata to disk. */
+	int fs_sync() {
+		int i, synced = 1;
+
+		pthread_rwlock_rdlock(&dir_lock);
+		pthread_mutex_lock(&cache_lock);
+		for (i = 0; i < cache_size && synced; i++)
+			synced = cache_flush_slot(i);
+		pthread_mutex_unlock(&cache_lock);
+
+		/* The data reaches the disk before the metadata pointing at it */
+		if (synced) synced = bl_flush() && checkpoint();
+		pthread_rwlock_unlock(&dir_lock);
+		return synced;
+	}
+
+/* txn_end: Forgets the undo log and copies of an open transaction, with meta_lock held. */
+static void txn_end() {
+	free(txn_undo);
+	free(txn_saved);
+	free(txn_dir);
+	free(txn_blocks);
+	txn_undo = NULL;
+	txn_undo_len = txn_undo_cap = 0;
+	txn_saved = NULL;
+	txn_dir = NULL;
+	txn_blocks = NULL;
+	txn_active = 0;
+	txn_seq++;
+	txn_copies = 0;
+}
+
+/* fs_begin: Function responsible for opening a transaction. Until fs_commit, metadata changed by
+	any call stays in memory, and fs_abort can roll fat[] and the directory back. Clusters
+	freed meanwhile stay held (free_hold), so a rollback finds them as they were. */
+	int fs_begin() {
+		int done;
+
+		pthread_rwlock_wrlock(&dir_lock);
+		pthread_mutex_lock(&meta_lock);
+		if (txn_active) {
+			pthread_mutex_unlock(&meta_lock);
+			pthread_rwlock_unlock(&dir_lock);
+			printf ("A transaction is already open.\n");
+			return 0;
+		}
+
+		/* Changes made before the transaction don't wait for it */
+		done = log_enabled ? log_commit() : flush_home();
+
+		txn_saved = calloc ((free_limit + 63)/64, sizeof(unsigned long));
+		txn_dir = malloc (dir_clusters*cluster_size);
+		txn_blocks = malloc (dir_clusters*sizeof(int));
+		if (!done || txn_saved == NULL || txn_dir == NULL || txn_blocks == NULL) {
+			txn_end();
+			pthread_mutex_unlock(&meta_lock);
+			pthread_rwlock_unlock(&dir_lock);
+			printf ("Failure opening the transaction!\n");
+			return 0;
+		}
+		memcpy (txn_dir, dir, dir_clusters*cluster_size);
+		memcpy (txn_blocks, dir_blocks, dir_clusters*sizeof(int));
+		txn_clusters = dir_clusters;
+		txn_active = 1;
+		txn_seq++;
+
+		pthread_mutex_unlock(&meta_lock);
+		pthread_rwlock_unlock(&dir_lock);
+		return 1;
+	}
+
+/* fs_commit: Function responsible for persisting the open transaction with a single metadata flush,
+	one commit block when it fits in the journal. */
+	int fs_commit() {
+		int done;
+
+		pthread_mutex_lock(&meta_lock);
+		if (!txn_active) {
+			pthread_mutex_unlock(&meta_lock);
+			printf ("No transaction is open.\n");
+			return 0;
+		}
+		txn_end();
+		done = log_enabled ? log_commit() : flush_home();
+		pthread_mutex_unlock(&meta_lock);
+		return done;
+	}
+
+/* fs_abort: Function responsible for rolling the open transaction back. Only metadata is restored,
+	bytes written over existing data stay. Files whose directory entry the transaction
+	changed must be closed first. */
+	int fs_abort() {
+		int i, entries;
+
+		pthread_rwlock_wrlock(&dir_lock);
+		pthread_mutex_lock(&meta_lock);
+		if (!txn_active) {
+			pthread_mutex_unlock(&meta_lock);
+			pthread_rwlock_unlock(&dir_lock);
+			printf ("No transaction is open.\n");
+			return 0;
+		}
+		if (txn_undo_len == -1) {
+			pthread_mutex_unlock(&meta_lock);
+			pthread_rwlock_unlock(&dir_lock);
+			printf ("Out of memory for the undo log, the transaction can only be committed.\n");
+			return 0;
+		}
+		if (txn_copies > 0) {
+			pthread_mutex_unlock(&meta_lock);
+			pthread_rwlock_unlock(&dir_lock);
+			printf ("Wait for the copies made by the transaction to finish.\n");
+			return 0;
+		}
+
+		entries = txn_clusters*DIR_PER_BLOCK;
+		for (i = 0; i < __atomic_load_n(&opened_slots, __ATOMIC_ACQUIRE); i++) {
+			if (opened_file_list[i]->id != -1 && (opened_file_list[i]->index >= entries ||
+					memcmp (&dir[opened_file_list[i]->index], &txn_dir[opened_file_list[i]->index], sizeof(dir_entry)))) {
+				pthread_mutex_unlock(&meta_lock);
+				pthread_rwlock_unlock(&dir_lock);
+				printf ("Close the files changed by the transaction first.\n");
+				return 0;
+			}
+		}
+
+		/* Clusters the transaction took are free again, with nothing of theirs cached */
+		for (i = txn_undo_len - 1; i >= 0; i--) {
+			if (txn_undo[i].value == FAT_FREE && fat[txn_undo[i].index] != FAT_FREE)
+				cache_invalidate(txn_undo[i].index, 1);
+			fat_set(txn_undo[i].index, txn_undo[i].value);
+		}
+
+		/* Clusters the directory grew by were given back with the FAT */
+		dir_resize(txn_clusters);
+		memcpy (dir_blocks, txn_blocks, txn_clusters*sizeof(int));
+		for (i = 0; i < entries; i++) {
+			if (memcmp (&dir[i], &txn_dir[i], sizeof(dir_entry))) {
+				memcpy (&dir[i], &txn_dir[i], sizeof(dir_entry));
+				dir_touch(i);
+				map_drop(i);
+				dir_life[i]++;
+			}
+		}
+		dir_index_rebuild();
+
+		/* Memory is back to what is on disk, nothing is left to persist. The clusters the
+		   batch freed are in use again, those it took are free on disk already */
+		txn_end();
+		log_clear();
+		free_release();
+		pthread_mutex_unlock(&meta_lock);
+		pthread_rwlock_unlock(&dir_lock);
+		return 1;
+	}
+
+/*write_block: Function responsible to write things in the virtual disk image.
+	The block is only written to the cache, it reaches the disk on eviction or fs_sync.
+	An image kept in memory is written in place and the cache is left alone. */
+int write_block(char *sectorBuffer, int sector){
+	char *data = bl_ptr(sector*cluster_sectors);
+	int hit, s;
+
+	if (data != NULL) {
+		memcpy (data, sectorBuffer, cluster_size);
+		return 1;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if ((s = cache_get(sector, &hit)) != -1) {
+		memcpy (cache[s].data, sectorBuffer, cluster_size);
+		cache[s].dirty = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return s != -1;
+}
+
 /*read_block: Function responsible for reading a block from the virtual disk image.*/
 int read_block(char *sectorBuffer, int sector){
-	int s;
-	for (s = 0; s < 8; s++) {
-		if (!bl_read ((sector*8)+s, &sectorBuffer[SECTORSIZE*s])) return 0;
+	char *data = bl_ptr(sector*cluster_sectors);
+	struct iovec iov;
+	int hit, s;
+
+	if (data != NULL) {
+		memcpy (sectorBuffer, data, cluster_size);
+		return 1;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if ((s = cache_get(sector, &hit)) == -1) {
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+	if (hit) {
+		cache_hits++;
+		if (cache[s].prefetched) {
+			ra_hits++;
+			cache[s].prefetched = 0;
+		}
+	} else {
+		cache_misses++;
+		/* the whole block (cluster_sectors sectors) comes in a single vectored read */
+		iov.iov_base = cache[s].data;
+		iov.iov_len = cluster_size;
+		if (!bl_readv (sector*cluster_sectors, &iov, 1)) {
+			cache_unhash(s);
+			pthread_mutex_unlock(&cache_lock);
+			return 0;
+		}
 	}
+	memcpy (sectorBuffer, cache[s].data, cluster_size);
+	pthread_mutex_unlock(&cache_lock);
 	return 1;
 }
 
-/* update: Function updates all modifications made in memory for both fat and directory. */
-int update(){
+/* read_part: Copies count bytes at offset of block to buffer, through aux (a cluster)
+	unless the image is in memory. */
+static int read_part(char *buffer, int block, int offset, int count, char *aux) {
+	char *data = bl_ptr(block*cluster_sectors);
+
+	if (data == NULL) {
+		if (!read_block (aux, block)) return 0;
+		data = aux;
+	}
+	memcpy (buffer, &data[offset], count);
+	return 1;
+}
+
+/* write_part: Copies count bytes from buffer to offset of block, through aux (a cluster)
+	unless the image is in memory. The rest of a fresh block is zeroed instead of read. */
+static int write_part(char *buffer, int block, int offset, int count, int fresh, char *aux) {
+	char *data = bl_ptr(block*cluster_sectors);
+	char *cluster = data != NULL ? data : aux;
+
+	if (fresh) {
+		memset (cluster, 0, cluster_size);
+	} else if (data == NULL && !read_block (aux, block)) {
+		return 0;
+	}
+	memcpy (&cluster[offset], buffer, count);
+	return data != NULL || write_block (aux, block);
+}
+
+/* cache_invalidate: Drops the cached copies of count blocks from block, about to be overwritten on disk. */
+static void cache_invalidate(int block, int count) {
+	int i, s;
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = block; i < block + count; i++) {
+		if ((s = cache_find(i)) != -1) {
+			cache[s].dirty = 0;
+			cache_unhash(s);
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* cache_writeback: Writes the dirty cached copies of count blocks from block to disk,
+	about to be read from there. */
+static int cache_writeback(int block, int count) {
+	int i, s, flushed = 1;
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = block; i < block + count && flushed; i++) {
+		if ((s = cache_find(i)) != -1)
+			flushed = cache_flush_slot(s);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return flushed;
+}
+
+/* write_run: Writes count contiguous blocks straight from buffer to the disk,
+	dropping any stale copy from the cache. */
+static int write_run(char *buffer, int block, int count, int aio) {
+	struct iovec iov = { buffer, (size_t) count*cluster_size };
+
+	cache_invalidate(block, count);
+	if (aio != -1) return aio_queue_run(aio, BL_WRITE, buffer, block, count);
+	return bl_writev (block*cluster_sectors, &iov, 1);
+}
+
+/* read_run: Reads count contiguous blocks straight from the disk to buffer.
+	Blocks in the cache may be newer than the disk, those are written back first
+	(the caller's file lock keeps them from being dirtied again meanwhile). */
+static int read_run(char *buffer, int block, int count, int aio) {
+	struct iovec iov = { buffer, (size_t) count*cluster_size };
+	int flushed = cache_writeback(block, count);
+
+	if (flushed && aio != -1) return aio_queue_run(aio, BL_READ, buffer, block, count);
+	return flushed && bl_readv (block*cluster_sectors, &iov, 1);
+}
+
+/* flush_runs: Writes to disk every run of consecutive dirty units of
+	unit bytes from base, the first unit living at sector first_sector. */
+static int flush_runs(char *dirty, int units, char *base, int unit, int first_sector) {
+	struct iovec iov;
+	int i, j;
+
+	for (i = 0; i < units; i = j + 1) {
+		for (; i < units && !dirty[i]; i++);
+		for (j = i; j < units && dirty[j]; j++);
+		if (i == units) break;
+
+		iov.iov_base = &base[i*unit];
+		iov.iov_len = (j - i) * unit;
+		if (!bl_writev (first_sector + i*(unit/SECTORSIZE), &iov, 1)) return 0;
+		memset (&dirty[i], 0, j - i);
+	}
+	return 1;
+}
+
+/* flush_home: Writes the FAT clusters and directory sectors modified in memory to their
+	place on disk, with meta_lock held. */
+static int flush_home() {
+	int c, i, per_sector = SECTORSIZE/sizeof(dir_entry);
+	char sector_dirty[CLUSTER_MAX/SECTORSIZE];
+
+	if (!flush_runs(fat_dirty, fat_clusters, (char *) fat, cluster_size, cluster_sectors)) return 0;
+
+	/* Directory is flushed a sector at a time, only where entries changed */
+	for (c = dir_dirty_lo/DIR_PER_BLOCK; c*DIR_PER_BLOCK <= dir_dirty_hi && c < dir_clusters; c++) {
+		memset (sector_dirty, 0, cluster_sectors);
+		for (i = 0; i < DIR_PER_BLOCK; i++)
+			if (dir_dirty[c*DIR_PER_BLOCK + i]) sector_dirty[i/per_sector] = 1;
+
+		if (!flush_runs(sector_dirty, cluster_size/SECTORSIZE, (char *) &dir[c*DIR_PER_BLOCK], SECTORSIZE, dir_blocks[c]*cluster_sectors)) return 0;
+		memset (&dir_dirty[c*DIR_PER_BLOCK], 0, DIR_PER_BLOCK);
+	}
+	dir_dirty_lo = dir_entries;
+	dir_dirty_hi = -1;
+	free_release();
+	return 1;
+}
+
+/* log_sum: Checksum of a commit block's records (FNV-1a). */
+static unsigned int log_sum(const char *data, int bytes) {
+	unsigned int h = 2166136261u;
 	int i;
-  	
-  	buffer = (char *) fat;
 
-	for (i = 0; i < 32; i++)
-		if(!write_block(&buffer[CLUSTERSIZE*i], i)) return 0;
-  
-  	buffer = (char *) dir;
-  	
-  	if (!write_block(buffer, 32)) return 0;
-  	
-  	return 1;
+	for (i = 0; i < bytes; i++)
+		h = (h ^ (unsigned char) data[i]) * 16777619u;
+	return h;
+}
+
+/* log_clear: Forgets the pending changes, they are in the log or home. */
+static void log_clear() {
+	int i, per_sector = SECTORSIZE/sizeof(fat[0]);
+
+	for (i = 0; i < fat_sectors; i++) {
+		if (fat_pending_sec[i]) {
+			memset (&fat_pending[i*per_sector], 0, per_sector);
+			fat_pending_sec[i] = 0;
+		}
+	}
+	if (dir_pending_hi >= dir_entries) dir_pending_hi = dir_entries - 1;
+	if (dir_pending_lo <= dir_pending_hi)
+		memset (&dir_pending[dir_pending_lo], 0, dir_pending_hi - dir_pending_lo + 1);
+	dir_pending_lo = dir_entries;
+	dir_pending_hi = -1;
+	log_records = 0;
+}
+
+/* log_write: Appends the pending changes to the log as one commit block.
+	Returns 1 when they made it, 0 when they don't fit in what is left of the log
+	or the write failed. */
+static int log_write() {
+	int room = (log_sectors - log_tail)*SECTORSIZE, len = sizeof(log_block);
+	int i, j, n, per_sector = SECTORSIZE/sizeof(fat[0]);
+	log_block *head = (log_block *) log_buf;
+	log_record rec;
+	struct iovec iov;
+
+	if (log_records == 0) return 1;
+
+	for (i = 0; i < fat_sectors; i++) {
+		if (!fat_pending_sec[i]) continue;
+		for (n = 0, j = i*per_sector; j < (i+1)*per_sector; j++)
+			n += fat_pending[j];
+
+		if (n > LOG_DENSE) {
+			if (len + (int) sizeof(rec) + SECTORSIZE > room) return 0;
+			rec.type = LOG_FATSEC;
+			rec.value = 0;
+			rec.index = i*per_sector;
+			memcpy (&log_buf[len], &rec, sizeof(rec));
+			memcpy (&log_buf[len + sizeof(rec)], &fat[i*per_sector], SECTORSIZE);
+			len += sizeof(rec) + SECTORSIZE;
+			continue;
+		}
+		for (j = i*per_sector; j < (i+1)*per_sector; j++) {
+			if (!fat_pending[j]) continue;
+			if (len + (int) sizeof(rec) > room) return 0;
+			rec.type = LOG_FAT;
+			rec.value = fat[j];
+			rec.index = j;
+			memcpy (&log_buf[len], &rec, sizeof(rec));
+			len += sizeof(rec);
+		}
+	}
+
+	for (i = dir_pending_lo; i <= dir_pending_hi && i < dir_entries; i++) {
+		if (!dir_pending[i]) continue;
+		if (len + (int) (sizeof(rec) + sizeof(dir_entry)) > room) return 0;
+		rec.type = LOG_DIR;
+		rec.value = 0;
+		rec.index = i;
+		memcpy (&log_buf[len], &rec, sizeof(rec));
+		memcpy (&log_buf[len + sizeof(rec)], &dir[i], sizeof(dir_entry));
+		len += sizeof(rec) + sizeof(dir_entry);
+	}
+
+	/* The block is padded to whole sectors */
+	n = (len + SECTORSIZE - 1) / SECTORSIZE;
+	memset (&log_buf[len], 0, n*SECTORSIZE - len);
+	head->magic = LOG_MAGIC;
+	head->epoch = log_epoch;
+	head->bytes = len - sizeof(log_block);
+	head->sum = log_sum(&log_buf[sizeof(log_block)], head->bytes);
+
+	iov.iov_base = log_buf;
+	iov.iov_len = n*SECTORSIZE;
+	if (!bl_writev (log_first*cluster_sectors + log_tail, &iov, 1)) return 0;
+	log_tail += n;
+	log_clear();
+	free_release();
+	return 1;
+}
+
+/* log_epoch_start: Empties the log on disk by writing the header of a new epoch. */
+static int log_epoch_start() {
+	struct iovec iov;
+	log_head *head = (log_head *) log_buf;
+
+	memset (log_buf, 0, SECTORSIZE);
+	head->magic = LOG_MAGIC;
+	head->epoch = ++log_epoch;
+	iov.iov_base = log_buf;
+	iov.iov_len = SECTORSIZE;
+	if (!bl_writev (log_first*cluster_sectors, &iov, 1) || !bl_flush()) return 0;
+
+	log_tail = 1;
+	return 1;
+}
+
+/* log_fold: Writes the records already in the log to their home sectors on disk and
+	starts a new epoch, leaving the pending changes out of both. Memory holds those
+	on top of the logged state, so home is patched from the log itself a sector at a
+	time. A fold cut short is finished by replaying the old epoch. Called with
+	meta_lock held. */
+static int log_fold() {
+	struct iovec iov;
+	log_block head;
+	log_record rec;
+	char home[SECTORSIZE];
+	int sector, pos, end, at = -1, len;
+	off_t byte;
+	char *data;
+
+	if (log_tail == 1) return 1;
+	iov.iov_base = log_buf;
+	iov.iov_len = log_tail*SECTORSIZE;
+	if (!bl_readv (log_first*cluster_sectors, &iov, 1)) return 0;
+
+	for (sector = 1; sector < log_tail; sector += (sizeof(head) + head.bytes + SECTORSIZE - 1) / SECTORSIZE) {
+		memcpy (&head, &log_buf[sector*SECTORSIZE], sizeof(head));
+		pos = sector*SECTORSIZE + sizeof(head);
+		end = pos + head.bytes;
+		while (pos + (int) sizeof(rec) <= end) {
+			memcpy (&rec, &log_buf[pos], sizeof(rec));
+			pos += sizeof(rec);
+
+			/* Byte offset of the record's home on disk, the FAT starts at cluster 1 */
+			if (rec.type == LOG_FAT && rec.index >= 0 && rec.index < free_limit) {
+				byte = cluster_size + (off_t) rec.index*sizeof(fat[0]);
+				data = (char *) &rec.value;
+				len = sizeof(fat[0]);
+			} else if (rec.type == LOG_FATSEC && rec.index >= 0 && rec.index < free_limit) {
+				byte = cluster_size + (off_t) rec.index*sizeof(fat[0]);
+				data = &log_buf[pos];
+				len = SECTORSIZE;
+				pos += len;
+			} else if (rec.type == LOG_DIR && rec.index >= 0 && rec.index < dir_entries) {
+				byte = (off_t) dir_blocks[rec.index / DIR_PER_BLOCK]*cluster_size + (rec.index % DIR_PER_BLOCK)*sizeof(dir_entry);
+				data = &log_buf[pos];
+				len = sizeof(dir_entry);
+				pos += len;
+			} else {
+				return 0;
+			}
+
+			if (byte/SECTORSIZE != at) {
+				if ((at != -1 && !bl_write (at, home)) || !bl_read (byte/SECTORSIZE, home)) return 0;
+				at = byte/SECTORSIZE;
+			}
+			memcpy (&home[byte % SECTORSIZE], data, len);
+		}
+	}
+	if (at != -1 && !bl_write (at, home)) return 0;
+	return bl_flush() && log_epoch_start();
+}
+
+/* log_checkpoint: Writes every metadata change home and empties the log by starting a
+	new epoch. Pending changes are logged first, so a home write cut short is repaired
+	by replay. When they don't fit in what is left of the log, the logged records are
+	folded home to make room. A group larger than the whole log is the exception, it
+	is written home without log coverage. Called with meta_lock held. */
+static int log_checkpoint() {
+	if (!log_write()) {
+		if (!log_fold()) return 0;
+		log_write();
+	}
+	if (!bl_flush() || !flush_home() || !bl_flush() || !log_epoch_start()) return 0;
+
+	log_clear();
+	return 1;
+}
+
+/* log_commit: Writes the pending group, checkpointing when the log is out of room
+	or three quarters full. Called with meta_lock held. */
+static int log_commit() {
+	if (!log_write() || log_tail > log_sectors*3/4) return log_checkpoint();
+	return 1;
+}
+
+/* log_flusher: Commits a group LOG_DELAY ms after its first change, unless it
+	filled up and was committed before. */
+static void *log_flusher(void *arg) {
+	struct timespec deadline;
+
+	pthread_mutex_lock(&meta_lock);
+	while (1) {
+		while (log_records == 0 || txn_active)
+			pthread_cond_wait(&log_cond, &meta_lock);
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_DELAY*1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		while (log_records > 0 && !txn_active && pthread_cond_timedwait(&log_cond, &meta_lock, &deadline) != ETIMEDOUT);
+
+		if (log_records > 0 && !txn_active) log_commit();
+	}
+	return NULL;
+}
+
+/* log_start: Turns the journal on, with meta_lock held. */
+static int log_start() {
+	static int flusher = 0;
+	pthread_t thread;
+	char *buf;
+
+	if ((buf = realloc (log_buf, log_sectors*SECTORSIZE)) == NULL) return 0;
+	log_buf = buf;
+	if (!flusher) {
+		if (pthread_create(&thread, NULL, log_flusher, NULL) != 0) return 0;
+		pthread_detach(thread);
+		flusher = 1;
+	}
+	log_enabled = 1;
+	return 1;
+}
+
+/* log_replay: Applies the commit blocks of the current epoch, in order, until one
+	is torn or belongs to an older epoch. Pass 0 applies FAT records, pass 1 the
+	directory ones (the directory chain is only known after the FAT). Returns
+	how many blocks were found. */
+static int log_replay(int pass) {
+	log_block head;
+	log_record rec;
+	int sector, pos, end, blocks = 0;
+
+	for (sector = 1; sector < log_sectors; sector += (sizeof(head) + head.bytes + SECTORSIZE - 1) / SECTORSIZE) {
+		memcpy (&head, &log_buf[sector*SECTORSIZE], sizeof(head));
+		if (head.magic != LOG_MAGIC || head.epoch != log_epoch ||
+				head.bytes > (unsigned int) ((log_sectors - sector)*SECTORSIZE - sizeof(head)) ||
+				log_sum(&log_buf[sector*SECTORSIZE + sizeof(head)], head.bytes) != head.sum)
+			break;
+
+		pos = sector*SECTORSIZE + sizeof(head);
+		end = pos + head.bytes;
+		while (pos + (int) sizeof(rec) <= end) {
+			memcpy (&rec, &log_buf[pos], sizeof(rec));
+			pos += sizeof(rec);
+			if (rec.type == LOG_FAT) {
+				if (pass == 0 && rec.index >= 0 && rec.index < free_limit) {
+					fat[rec.index] = rec.value;
+					fat_dirty[rec.index / (cluster_size/sizeof(fat[0]))] = 1;
+				}
+			} else if (rec.type == LOG_FATSEC) {
+				if (pass == 0 && rec.index >= 0 && rec.index % (SECTORSIZE/sizeof(fat[0])) == 0 && rec.index < free_limit) {
+					memcpy (&fat[rec.index], &log_buf[pos], SECTORSIZE);
+					fat_dirty[rec.index / (cluster_size/sizeof(fat[0]))] = 1;
+				}
+				pos += SECTORSIZE;
+			} else if (rec.type == LOG_DIR) {
+				if (pass == 1 && rec.index >= 0 && rec.index < dir_entries) {
+					memcpy (&dir[rec.index], &log_buf[pos], sizeof(dir_entry));
+					dir_touch(rec.index);
+				}
+				pos += sizeof(dir_entry);
+			} else {
+				break;
+			}
+		}
+		blocks++;
+	}
+	return blocks;
+}
+
+/* log_open: Finds the journal of the loaded FAT and reads it whole. Returns 1
+	when the image has one. */
+static int log_open() {
+	struct iovec iov;
+	log_head head;
+	char *buf;
+	int i;
+
+	if (log_clusters == 0) return 0;
+	for (i = log_first; i < log_first + log_clusters; i++)
+		if (fat[i] != LOG_MARK) return 0;
+
+	if ((buf = realloc (log_buf, log_sectors*SECTORSIZE)) == NULL) return 0;
+	log_buf = buf;
+	iov.iov_base = log_buf;
+	iov.iov_len = log_sectors*SECTORSIZE;
+	if (!bl_readv (log_first*cluster_sectors, &iov, 1)) return 0;
+
+	memcpy (&head, log_buf, sizeof(head));
+	if (head.magic != LOG_MAGIC) return 0;
+	log_epoch = head.epoch;
+	return 1;
+}
+
+/* update: Function makes the metadata modified in memory persistent. With a journal the
+	changes join the group being committed, otherwise they are written home at once.
+	Inside a transaction they wait for fs_commit. */
+int update(){
+	int updated = 1;
+
+	pthread_mutex_lock(&meta_lock);
+	if (txn_active) {
+		/* fs_commit persists the whole transaction */
+	} else if (!log_enabled) {
+		updated = flush_home();
+	} else if (log_records >= LOG_GROUP) {
+		updated = log_commit();
+	} else if (log_records > 0) {
+		pthread_cond_signal(&log_cond);
+	}
+	pthread_mutex_unlock(&meta_lock);
+	return updated;
+}
+
+/* checkpoint: Function writes every metadata change home and flushes the disk, leaving the journal empty.
+	An open transaction is left alone. */
+int checkpoint(){
+	int done;
+
+	pthread_mutex_lock(&meta_lock);
+	if (txn_active) done = 1;
+	else done = log_enabled ? log_checkpoint() : flush_home() && bl_flush();
+	pthread_mutex_unlock(&meta_lock);
+	return done;
 }
@@ -25,8 +25,8 @@
 
 /*Base Functions*/
 int fs_init();
-int fs_format();
-int fs_free();
+int fs_format(int size);
+long fs_free();
 int fs_list(char *buffer, int size);
 int fs_create(char *file_name);
 int fs_remove(char *file_name);
@@ -34,7 +34,34 @@ int fs_open(char *file_name, int mode);
 int fs_close(int file);
 int fs_write(char *buffer, int size, int file);
 int fs_read(char *buffer, int size, int file);
+int fs_fallocate(int file, int bytes);
+int fs_seek(int file, int offset);
+int fs_pread(char *buffer, int size, int file, int offset);
+int fs_pwrite(char *buffer, int size, int file, int offset);
+int fs_sync();
+int fs_copy(char *src, char *dst);
+int fs_import(char *name, int host, int size);
+int fs_export(char *name, int host);
+int fs_frag_report(char *buffer, int size);
+int fs_defrag(int budget_ms, int *pending);
+
+/*Transactions*/
+int fs_begin();
+int fs_commit();
+int fs_abort();
+
+/*Asynchronous I/O*/
+int fs_read_async(char *buffer, int size, int file, int offset);
+int fs_write_async(char *buffer, int size, int file, int offset);
+int fs_aio_wait(int request);
+
+/*Buffer Cache*/
+int fs_cache(int clusters);
+void fs_cache_stats(long *hits, long *misses);
+void fs_readahead_stats(long *prefetched, long *hits);
+void fs_mount_stats(long *mount, long *index);
 
 /*Auxiliary Functions*/
 int checkdisk();
-int update();
\ No newline at end of file
+int update();
+int checkpoint();
\ No newline at end of file
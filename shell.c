@@ -20,55 +20,133 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
 
 #define MAX_STR 256
 #define MAX_ARG 32
-#define COPY_BUFFER_SIZE 10
 
-void format();
+void format(int size);
 void list();
 void create(char *file);
 void fremove(char *file);
 void copy(char *file1, char *file2);
 void copyf(char *file1, char *file2);
 void copyt(char *file1, char *file2);
+void stats();
+void batch(char *action);
+void frag();
+void defrag(int budget);
+void load(char *file);
+void dump(char *file);
+
+/* Set while a batch is open, so exit can commit it */
+int batching = 0;
 
 int main(int argc, char **argv) {
-  char *image;
+  char *image, *name = argv[0];
   int size;
   char linha[MAX_STR];
   char *args[MAX_ARG + 1];
   char *token;
-  int i, tam;
+  char *files[MAX_ARG];
+  int i, tam, opt, backend, policy, huge, direct, exists, unit;
+  long mount, index;
+
+  backend = BL_FILE;
+  huge = 0;
+  direct = 0;
+  unit = STRIPE_UNIT;
+  policy = BL_SYNC_FLUSH;
+  while ((opt = getopt(argc, argv, "b:s:u:Hd")) != -1) {
+    if (opt == 'H') {
+      huge = BL_HUGE;
+    } else if (opt == 'd') {
+      direct = BL_DIRECT;
+    } else if (opt == 'u' && atoi(optarg) > 0) {
+      unit = atoi(optarg) * 2; /* Each KiB has 2 sectors. */
+    } else if (opt == 'b' && !strcmp(optarg, "file")) {
+      backend = BL_FILE;
+    } else if (opt == 'b' && !strcmp(optarg, "mmap")) {
+      backend = BL_MMAP;
+    } else if (opt == 'b' && !strcmp(optarg, "ram")) {
+      backend = BL_RAM;
+    } else if (opt == 'b' && !strcmp(optarg, "stripe")) {
+      backend = BL_STRIPE;
+    } else if (opt == 's' && !strcmp(optarg, "flush")) {
+      policy = BL_SYNC_FLUSH;
+    } else if (opt == 's' && !strcmp(optarg, "async")) {
+      policy = BL_SYNC_ASYNC;
+    } else if (opt == 's' && !strcmp(optarg, "none")) {
+      policy = BL_SYNC_NONE;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
+  argc -= optind;
+  argv += optind;
 
   size = -1;
-  if (argc >= 2 && argc <= 3) {
-    image = argv[1];
-    if (argc > 2) {
-      size = atoi(argv[2]) * 2048; /* Each MB has 2048 sectors. */
+  if (argc >= 1 && argc <= 2) {
+    image = argv[0];
+    if (argc > 1) {
+      size = atoi(argv[1]) * 2048; /* Each MB has 2048 sectors. */
     }
   } else {
-    printf("How-To-Use: %s image [size]\n", argv[0]);
+    printf("How-To-Use: %s [-b backend] [-s sync] [-H] [-d] [-u unit] image [size]\n", name);
     printf("Where: image is the file containing the disk image.\n");
     printf("      size (optional) refers to the size of the image in MB.\n");
+    printf("      backend is file (read and write the image, default), mmap\n");
+    printf("              (map it into memory), ram (keep the disk in memory\n");
+    printf("              only, loaded from image if it exists) or stripe (image\n");
+    printf("              is a comma separated list of files to stripe over).\n");
+    printf("      -H backs a ram disk with huge pages.\n");
+    printf("      -d reads and writes a file image with direct I/O.\n");
+    printf("      unit is the stripe unit in KiB (default %d).\n", STRIPE_UNIT / 2);
+    printf("      sync is what a sync waits for: flush (the data is on disk,\n");
+    printf("           default), async (writing started) or none.\n");
     exit(0);
   }
 
-  if (!bl_init(image, size)) {
-    exit(0);
+  bl_sync_policy(policy);
+  if (backend == BL_STRIPE) {
+    token = strdup(image);
+    for (i = 0, token = strtok(token, ","); token != NULL && i < MAX_ARG; token = strtok(NULL, ",")) {
+      files[i++] = token;
+    }
+    if (!bl_open_stripe(files, i, size, unit)) {
+      exit(0);
+    }
+    printf("Image files %s opened, striped in %d KiB units.\n", image, unit / 2);
+  } else {
+    exists = access(image, F_OK) == 0;
+    if (!bl_open(image, size, backend | (backend == BL_RAM ? huge : 0) | (backend == BL_FILE ? direct : 0))) {
+      exit(0);
+    }
+    if (backend != BL_RAM) {
+      printf("Image file %s opened.\n", image);
+    } else if (exists) {
+      printf("RAM disk loaded from %s.\n", image);
+    } else {
+      printf("RAM disk created, dump saves it to %s.\n", image);
+    }
   }
-  printf("Image file %s opened.\n", image);
-  printf("Size %d sectors (%d bytes).\n", bl_size(), bl_size() * SECTORSIZE);
+  printf("Size %d sectors (%lld bytes).\n", bl_size(), (long long) bl_size() * SECTORSIZE);
   
   if (!fs_init()) {
     exit(0);
   }
+  fs_mount_stats(&mount, &index);
+  printf("Mounted in %.1f ms.\n", mount / 1000.0);
 
   while (1) {
     printf("> ");
@@ -93,9 +171,55 @@ int main(int argc, char **argv) {
     }
 
     if (!strcmp(args[0], "exit")) {
+      if (batching) {
+	fs_commit();
+      }
+      fs_sync();
       exit(EXIT_SUCCESS);
+    } else if (!strcmp(args[0], "sync")) {
+      fs_sync();
+    } else if (!strcmp(args[0], "stats")) {
+      stats();
+    } else if (!strcmp(args[0], "batch")) {
+      if (i == 2) {
+	batch(args[1]);
+      } else {
+	printf("How-To-Use: batch begin|commit|abort\n");
+      }
+    } else if (!strcmp(args[0], "cache")) {
+      if (i == 2 && atoi(args[1]) > 0) {
+	fs_cache(atoi(args[1]));
+      } else {
+	printf("How-To-Use: cache <clusters>\n");
+      }
+    } else if (!strcmp(args[0], "frag")) {
+      frag();
+    } else if (!strcmp(args[0], "defrag")) {
+      if (i <= 2) {
+	defrag(i == 2 ? atoi(args[1]) : 0);
+      } else {
+	printf("How-To-Use: defrag [milliseconds]\n");
+      }
+    } else if (!strcmp(args[0], "load")) {
+      if (i <= 2) {
+	load(i == 2 ? args[1] : image);
+      } else {
+	printf("How-To-Use: load [image]\n");
+      }
+    } else if (!strcmp(args[0], "dump")) {
+      if (i == 2 || (i == 1 && backend == BL_RAM)) {
+	dump(i == 2 ? args[1] : image);
+      } else if (backend == BL_RAM) {
+	printf("How-To-Use: dump [image]\n");
+      } else {
+	printf("How-To-Use: dump <image>\n");
+      }
     } else if (!strcmp(args[0], "format")) {
-      format();
+      if (i <= 2) {
+	format(i == 2 ? atoi(args[1]) * 1024 : 0);
+      } else {
+	printf("How-To-Use: format [cluster size in KiB]\n");
+      }
     } else if (!strcmp(args[0], "list")) {
       list();
     } else if (!strcmp(args[0], "create")) {
@@ -134,17 +258,25 @@ int main(int argc, char **argv) {
   }
 }
 
-void format() {
-  if (fs_format()) {
-    printf("Completed formatting. %d free bytes.\n", fs_free());
+void format(int size) {
+  if (fs_format(size)) {
+    batching = 0;
+    printf("Completed formatting. %ld free bytes.\n", fs_free());
   }
 }
 
 void list() {
-  char buffer[4096];
-  if (fs_list(buffer, 4096)) {
+  char *buffer = NULL;
+  int size = 4096;
+
+  /* The directory can grow past a single cluster, retry with more room. */
+  while ((buffer = realloc(buffer, size)) != NULL && !fs_list(buffer, size)) {
+    size *= 2;
+  }
+  if (buffer != NULL) {
     printf("%s", buffer);
-    printf("%d free bytes.\n", fs_free());
+    printf("%ld free bytes.\n", fs_free());
+    free(buffer);
   }
 }
 
@@ -157,79 +289,114 @@ void fremove(char *file) {
 }
 
 void copy(char *file1, char *file2) {
-  int fd1, fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  int read;
+  fs_copy(file1, file2);
+}
 
-  if ((fd1 = fs_open(file1, FS_R)) == -1) {
-    return;
-  }
+void copyf(char *file1, char *file2) {
+  int fd;
+  struct stat sb;
 
-  if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fs_close(fd1);
+  if ((fd = open(file1, O_RDONLY)) == -1) {
+    perror("Opening real file for copy (read mode)");
     return;
   }
-  while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fs_write(buffer, read, fd2) != read) {
-      return;
-    }
+  if (fstat(fd, &sb) == -1) {
+    perror("Reading real file size");
+  } else if (sb.st_size > INT_MAX) {
+    printf("%s is too large, files can hold up to %d bytes.\n", file1, INT_MAX);
+  } else {
+    fs_import(file2, fd, sb.st_size);
   }
-
-  fs_close(fd1);
-  fs_close(fd2);
+  close(fd);
 }
 
-void copyf(char *file1, char *file2) {
-  int fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
+/* The copy goes to a temporary file next to file2 that replaces it once complete,
+   so a failed copy leaves whatever file2 was untouched. */
+void copyt(char *file1, char *file2) {
+  char temp[MAX_STR + 16];
+  mode_t mask;
+  int fd;
 
-  stream = fopen(file1, "r");
-  if (stream == NULL) {
-    perror("Opening real file for copy (read mode)");
+  snprintf(temp, sizeof(temp), "%s.XXXXXX", file2);
+  if ((fd = mkstemp(temp)) == -1) {
+    perror("Opening real file for copy (write mode)");
     return;
   }
+  mask = umask(0);
+  umask(mask);
+  fchmod(fd, 0666 & ~mask);
+  if (!fs_export(file1, fd)) {
+    unlink(temp);
+  } else if (rename(temp, file2) == -1) {
+    perror("Replacing real file");
+    unlink(temp);
+  }
+  close(fd);
+}
 
-  if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fclose(stream);
-    return;
+void stats() {
+  long hits, misses, prefetched, used, mount, index;
+
+  fs_cache_stats(&hits, &misses);
+  fs_readahead_stats(&prefetched, &used);
+  printf("Cache: %ld hits, %ld misses.\n", hits, misses);
+  printf("Read-ahead: %ld clusters prefetched, %ld used.\n", prefetched, used);
+  fs_mount_stats(&mount, &index);
+  if (index < 0) {
+    printf("Mount: %.1f ms, indexes still building.\n", mount / 1000.0);
+  } else {
+    printf("Mount: %.1f ms, indexes built in %.1f ms.\n", mount / 1000.0, index / 1000.0);
   }
+}
 
-  while ((read = fread(buffer, sizeof(char), COPY_BUFFER_SIZE, stream)) > 0) {
-    if (fs_write(buffer, read, fd2) != read) {
-      return;
+void batch(char *action) {
+  if (!strcmp(action, "begin")) {
+    if (fs_begin()) {
+      batching = 1;
+    }
+  } else if (!strcmp(action, "commit")) {
+    if (fs_commit()) {
+      batching = 0;
     }
+  } else if (!strcmp(action, "abort")) {
+    if (fs_abort()) {
+      batching = 0;
+    }
+  } else {
+    printf("How-To-Use: batch begin|commit|abort\n");
   }
-
-  fclose(stream);
-  fs_close(fd2);
 }
 
-void copyt(char *file1, char *file2) {
-  int fd1;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
+void frag() {
+  char *buffer = NULL;
+  int size = 4096;
 
-  if ((fd1 = fs_open(file1, FS_R)) == -1) {
-    return;
+  while ((buffer = realloc(buffer, size)) != NULL && !fs_frag_report(buffer, size)) {
+    size *= 2;
+  }
+  if (buffer != NULL) {
+    printf("%s", buffer);
+    free(buffer);
   }
+}
 
-  stream = fopen(file2, "w+");
-  if (stream == NULL) {
-    perror("Opening real file for copy (write mode)");
-    fs_close(fd1);
-    return;
+void load(char *file) {
+  if (bl_load(file) && fs_init()) {
+    batching = 0;
+    printf("Loaded %s, %lld bytes.\n", file, (long long) bl_size() * SECTORSIZE);
   }
+}
 
-  while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fwrite(buffer, sizeof(char), read, stream) != read) {
-      perror("Writing real file");
-      return;
-    }
+void dump(char *file) {
+  if (fs_sync() && bl_dump(file)) {
+    printf("Dumped to %s.\n", file);
   }
+}
+
+void defrag(int budget) {
+  int moved, pending;
 
-  fs_close(fd1);
-  fclose(stream);
+  if ((moved = fs_defrag(budget, &pending)) >= 0) {
+    printf("%d files moved, %d still fragmented.\n", moved, pending);
+  }
 }